@@ -0,0 +1,111 @@
+#include "./include/Admin.hpp"
+
+#include "./include/Bus.hpp"
+#include "./include/ChatServer.hpp"
+#include "./include/Command.hpp"
+#include "./include/Frame.hpp"
+#include "./include/Metrics.hpp"
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace server {
+
+Admin::Admin(ChatServer* server, std::string path) : server(server), path(std::move(path)) {}
+
+bool Admin::start() {
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+  sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    return false;
+  }
+
+  // A leftover from a previous run would make bind fail
+  unlink(path.c_str());
+
+  // Nobody but us gets to connect, that's the whole access check
+  mode_t old = umask(0077);
+  int bound = bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  umask(old);
+  if (bound < 0 || listen(sock, 8) < 0) {
+    close(sock);
+    return false;
+  }
+
+  pthread_t t;
+  pthread_create(&t, nullptr, Admin::serve, this);
+  pthread_detach(t);
+
+  return true;
+}
+
+void* Admin::serve(void* args) {
+  Admin* admin = static_cast<Admin*>(args);
+
+  while (true) {
+    int client = accept(admin->sock, nullptr, nullptr);
+    if (client < 0) {
+      continue;
+    }
+
+    // Commands are one short line
+    std::string line;
+    char c;
+    while (line.size() < 256 && recv(client, &c, 1, 0) == 1 && c != '\n') {
+      line += c;
+    }
+
+    const std::string reply = admin->run(line);
+    frame::send_all(client, reply.data(), reply.size());
+    close(client);
+  }
+
+  return nullptr;
+}
+
+std::string Admin::run(const std::string& line) {
+  command::Tokens args{std::string_view(line)};
+  std::string_view what = args.next();
+
+  if (what == "stats") {
+    return metrics::report();
+  }
+
+  if (what == "list") {
+    std::string out;
+    std::lock_guard<std::mutex> lock(server->users_lock);
+    for (const auto& user : server->users) {
+      out += user.username + "\n";
+    }
+    return out;
+  }
+
+  if (what == "kick") {
+    std::string_view who = args.next();
+    if (who.empty()) {
+      return "usage: kick <name>\n";
+    }
+
+    std::cout << "Admin kicked " << who << std::endl;
+    server->kick_user(who);
+    if (server->bus != nullptr) {
+      server->bus->kick(who);
+    }
+    return "ok\n";
+  }
+
+  return "commands: stats, list, kick <name>\n";
+}
+
+} // namespace server
@@ -0,0 +1,127 @@
+#include "./include/Crypto.hpp"
+#include "./include/Frame.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Times /broadcast fan-out the way ChatServer does it: the old per message
+// CBC setup, per recipient GCM sessions and the shared room key. Frames are
+// written to /dev/null so the syscall cost stays in the picture without 10k
+// sockets.
+namespace {
+
+struct recipient {
+  unsigned char key[32];
+  std::unique_ptr<yep::Session> session;
+};
+
+std::string seal_cbc(yep::Crypto& crypto, const std::string& message, unsigned char* key, frame::Type type) {
+  unsigned char miv[16];
+  std::memset(miv, 0, 16);
+  std::vector<unsigned char> ciphertext(message.size() + 16);
+
+  int len = crypto.encrypt(
+      (unsigned char*)message.c_str(),
+      message.size(),
+      key,
+      miv,
+      ciphertext.data());
+
+  return frame::make(type, ciphertext.data(), len);
+}
+
+double per_message_ctx(std::vector<recipient>& users, const std::string& message, int rounds, int sink) {
+  yep::Crypto crypto;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int r = 0; r < rounds; ++r) {
+    for (auto& user : users) {
+      std::string f = seal_cbc(crypto, message, user.key, frame::direct);
+      write(sink, f.data(), f.size());
+    }
+  }
+
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  return took.count();
+}
+
+double per_user(std::vector<recipient>& users, const std::string& message, int rounds, int sink) {
+  std::string f;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int r = 0; r < rounds; ++r) {
+    for (auto& user : users) {
+      f.clear();
+      user.session->seal(frame::direct, (const unsigned char*)message.data(), message.size(), f);
+      write(sink, f.data(), f.size());
+    }
+  }
+
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  return took.count();
+}
+
+double room_key(std::vector<recipient>& users, const std::string& message, int rounds, int sink) {
+  unsigned char key[32];
+  RAND_bytes(key, 32);
+  yep::Session room(key, yep::Session::server);
+  std::string f;
+  auto start = std::chrono::steady_clock::now();
+
+  for (int r = 0; r < rounds; ++r) {
+    f.clear();
+    room.seal(frame::group, (const unsigned char*)message.data(), message.size(), f);
+    for (size_t i = 0; i < users.size(); ++i) {
+      write(sink, f.data(), f.size());
+    }
+  }
+
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+  return took.count();
+}
+
+void report(const char* name, size_t recipients, int rounds, double seconds) {
+  double broadcasts = rounds / seconds;
+  std::cout << name << ": "
+    << broadcasts << " broadcasts/sec, "
+    << broadcasts * recipients << " messages/sec" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  size_t recipients = argc > 1 ? std::stoul(argv[1]) : 10000;
+  int rounds = argc > 2 ? std::stoi(argv[2]) : 20;
+  std::string message = "hello everybody, this is a broadcast";
+
+  std::vector<recipient> users(recipients);
+  for (auto& user : users) {
+    RAND_bytes(user.key, 32);
+    user.session.reset(new yep::Session(user.key, yep::Session::server));
+  }
+
+  int sink = open("/dev/null", O_WRONLY);
+  if (sink < 0) {
+    std::cerr << "Failed to open /dev/null" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  double fresh = per_message_ctx(users, message, rounds, sink);
+  double sessions = per_user(users, message, rounds, sink);
+  double room = room_key(users, message, rounds, sink);
+
+  std::cout << recipients << " recipients, " << rounds << " broadcasts" << std::endl;
+  report("new ctx per message", recipients, rounds, fresh);
+  report("per user session   ", recipients, rounds, sessions);
+  report("room key           ", recipients, rounds, room);
+
+  close(sink);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include "./include/Bus.hpp"
+
+#include "./include/ChatServer.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace server {
+
+Bus::Bus(size_t count) : inbox(count, -1), outbox(count, -1) {
+  for (size_t i = 0; i < count; ++i) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair) < 0) {
+      std::cerr << "Failed to create the worker bus" << std::endl;
+      abort();
+    }
+    inbox[i] = pair[0];
+    outbox[i] = pair[1];
+
+    // Room for a full size message plus a backlog of small ones
+    int size = 4 * MAX_MESSAGE;
+    setsockopt(pair[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(pair[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+}
+
+void Bus::attach(size_t index) {
+  self = index;
+
+  for (size_t i = 0; i < inbox.size(); ++i) {
+    if (i != self) {
+      close(inbox[i]);
+      inbox[i] = -1;
+    }
+  }
+  // Nobody needs to talk to themselves
+  close(outbox[self]);
+  outbox[self] = -1;
+}
+
+void Bus::start(ChatServer* server) {
+  this->server = server;
+
+  pthread_t t;
+  pthread_create(&t, nullptr, Bus::receiver, this);
+  pthread_detach(t);
+}
+
+std::string Bus::pack(kind k, size_t from, std::string_view name, std::string_view body) {
+  std::string message;
+  message.reserve(3 + name.size() + body.size());
+  message += static_cast<char>(k);
+  message += static_cast<char>(from);
+  message += static_cast<char>(name.size());
+  message.append(name.data(), name.size());
+  message.append(body.data(), body.size());
+
+  return message;
+}
+
+// Set on the receiver thread. What it applies can send in turn (a kick
+// announces the leave), and two receivers blocked on each other's full
+// inbox would never wake up.
+static thread_local bool on_receiver = false;
+
+void Bus::send_to(size_t index, const std::string& message) {
+  if (message.size() > MAX_MESSAGE) {
+    std::cout << "Message too big for the worker bus, kept local" << std::endl;
+    return;
+  }
+
+  // Anyone else blocks if that worker is behind, the receiver drops instead
+  int flags = MSG_NOSIGNAL | (on_receiver ? MSG_DONTWAIT : 0);
+  ssize_t r;
+  while ((r = send(outbox[index], message.data(), message.size(), flags)) < 0 && errno == EINTR) {}
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    std::cout << "Worker " << index << " is behind, dropped a bus message" << std::endl;
+  }
+}
+
+void Bus::send_all(const std::string& message) {
+  for (size_t i = 0; i < outbox.size(); ++i) {
+    if (i != self) {
+      send_to(i, message);
+    }
+  }
+}
+
+void Bus::owners(std::string_view name, std::vector<size_t>& out) {
+  std::lock_guard<std::mutex> lock(presence_lock);
+  auto range = presence.equal_range(std::string(name));
+  for (auto it = range.first; it != range.second; ++it) {
+    // Same name twice on one worker only needs one copy
+    bool seen = false;
+    for (size_t w : out) {
+      seen = seen || w == it->second;
+    }
+    if (!seen) {
+      out.push_back(it->second);
+    }
+  }
+}
+
+void Bus::joined(std::string_view name) {
+  send_all(pack(JOIN, self, name, ""));
+}
+
+void Bus::left(std::string_view name) {
+  send_all(pack(LEAVE, self, name, ""));
+}
+
+void Bus::broadcast(std::string_view body) {
+  send_all(pack(BROADCAST, self, "", body));
+}
+
+void Bus::pm(std::string_view who, std::string_view body) {
+  std::vector<size_t> to;
+  owners(who, to);
+  if (to.empty()) {
+    return;
+  }
+
+  const std::string message = pack(PM, self, who, body);
+  for (size_t w : to) {
+    send_to(w, message);
+  }
+}
+
+void Bus::kick(std::string_view who) {
+  std::vector<size_t> to;
+  owners(who, to);
+
+  for (size_t w : to) {
+    send_to(w, pack(KICK, self, who, ""));
+  }
+}
+
+void Bus::remote_names(std::vector<std::string>& out) {
+  std::lock_guard<std::mutex> lock(presence_lock);
+  for (const auto& entry : presence) {
+    out.push_back(entry.first);
+  }
+}
+
+void* Bus::receiver(void* args) {
+  Bus* bus = static_cast<Bus*>(args);
+  std::vector<char> buf(MAX_MESSAGE);
+  on_receiver = true;
+
+  while (true) {
+    ssize_t r = recv(bus->inbox[bus->self], buf.data(), buf.size(), 0);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      std::cerr << "Worker bus went away" << std::endl;
+      return nullptr;
+    }
+
+    bus->apply(buf.data(), r);
+  }
+
+  return nullptr;
+}
+
+void Bus::apply(const char* data, size_t len) {
+  if (len < 3 || len < 3 + static_cast<size_t>(static_cast<unsigned char>(data[2]))) {
+    return;
+  }
+
+  kind k = static_cast<kind>(data[0]);
+  size_t from = static_cast<unsigned char>(data[1]);
+  size_t name_len = static_cast<unsigned char>(data[2]);
+  std::string_view name(data + 3, name_len);
+  std::string_view body(data + 3 + name_len, len - 3 - name_len);
+
+  if (k == JOIN) {
+    std::lock_guard<std::mutex> lock(presence_lock);
+    presence.emplace(std::string(name), from);
+  } else if (k == LEAVE) {
+    std::lock_guard<std::mutex> lock(presence_lock);
+    auto range = presence.equal_range(std::string(name));
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == from) {
+        presence.erase(it);
+        break;
+      }
+    }
+  } else if (k == BROADCAST) {
+    server->deliver_broadcast(body);
+  } else if (k == PM) {
+    server->deliver_pm(name, body);
+  } else if (k == KICK) {
+    server->kick_user(name);
+  }
+}
+
+} // namespace server
@@ -0,0 +1,47 @@
+#include "./include/Frame.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one command to a running server's admin socket and prints the
+// reply, e.g.
+//   chatadmin chat_admin.sock stats
+//   chatadmin chat_admin.sock kick alice
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: chatadmin <socket> <stats|list|kick <name>>" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  std::strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    std::cerr << "Can't reach the server at " << argv[1] << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::string line;
+  for (int i = 2; i < argc; ++i) {
+    line += argv[i];
+    line += i + 1 < argc ? ' ' : '\n';
+  }
+  frame::send_all(sock, line.data(), line.size());
+
+  char buf[4096];
+  ssize_t r;
+  while ((r = recv(sock, buf, sizeof(buf), 0)) > 0) {
+    std::cout.write(buf, r);
+  }
+  close(sock);
+
+  return EXIT_SUCCESS;
+}
@@ -1,13 +1,14 @@
 #include "./include/ChatClient.hpp"
-#include "./include/User.hpp"
-#include "./include/Succ.hpp"
 #include "./include/Crypto.hpp"
+#include "./include/EventLoop.hpp"
+#include "./include/Frame.hpp"
 
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -17,78 +18,56 @@
 #include <tuple>
 #include <unistd.h>
 
-void* client::ChatClient::client_handler(void* args) {
-  the::Succ SLIP_SLOP;
-  yep::Crypto JEFF;
-  ChatClient::thread t;
-  ChatClient::std_message s;
-  std::memcpy(&t, args, sizeof(ChatClient::thread));
-
-  std::string data;
-  while (data != "/quit" && data != "kicked") {
-
-    char buf[4096];
-    std::memset(buf, 0, sizeof(buf));
-    int inlen = recv(t.socket, buf, 4096, 0);
-    // Decrypt our message
-    unsigned char* ciphertext = (unsigned char*)buf;
-
-    unsigned char miv[16];
-    std::memset(miv, 0, 16);
-
-    unsigned char plaintext[1024];
-    std::memset(plaintext, 0, 1024);
-    
-    int plaintext_len = JEFF.decrypt(ciphertext, inlen, t.key, miv, plaintext);
-
-    
-    data = std::string((char *)plaintext);
-    if (data == "kicked") {
-      std::cout << "OHH HO HO HOOO YOU HAVE BEEN KICKED MY BOY" << std::endl;
-      exit(0);
-      return nullptr;
-    }
-    std::cout << " <<< " << data << "\n <<< " << std::endl;
-  }
-
-  return nullptr;
-}
 namespace client {
 
 in_addr_t ChatClient::handle_host() {
   std::cout << "Please enter the host you would like to connect to: " << std::flush;
-  std::string host = "";
-  std::getline(std::cin, host);
+  std::string host = read_line();
 
   return inet_addr(host.c_str());
 }
 
 int ChatClient::handle_port() {
   std::cout << "Please enter the port to connect from: " << std::flush;
-  std::string port = "";
-  std::getline(std::cin, port);
+  std::string port = read_line();
 
   return std::stoi(port);
 }
 
+std::string ChatClient::read_line() {
+  std::string line;
+  char c;
+  while (read(STDIN_FILENO, &c, 1) == 1 && c != '\n') {
+    line += c;
+  }
+
+  return line;
+}
+
+EVP_PKEY* ChatClient::load_public_key(const char* path) {
+  FILE* pubf = fopen(path, "rb");
+  if (pubf == nullptr) {
+    return nullptr;
+  }
 
-std::string ChatClient::handle_input() {
-  std::cout << " >>> " << std::flush;
-  std::string message = "";
-  std::getline(std::cin, message);
+  EVP_PKEY* pubkey = PEM_read_PUBKEY(pubf, nullptr, nullptr, nullptr);
+  fclose(pubf);
 
-  return message;
+  return pubkey;
 }
 
-int ChatClient::RunClient() {
+int ChatClient::handshake(
+    in_addr_t host,
+    int port,
+    EVP_PKEY* pubkey,
+    const std::string& username,
+    unsigned char key[32]) {
   int sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
   if (sockfd < 0) {
     std::cerr << "Error creating the socket" << std::endl;
-    return EXIT_FAILURE;
+    return -1;
   }
-  int port = handle_port();
-  in_addr_t host = handle_host();
 
   struct sockaddr_in server;
   server.sin_family = AF_INET;
@@ -100,101 +79,111 @@ int ChatClient::RunClient() {
   int c = connect(sockfd, reinterpret_cast<sockaddr*>(&server), sin_size);
   if (c < 0) {
     std::cerr << "Error connecting" << std::endl;
-    return EXIT_FAILURE;
+    close(sockfd);
+    return -1;
   }
 
-  std::cout << "You connected." << std::endl;
-
-  std::string username = "";
-  ChatClient::symmetric_key_message skm;
-  int taken = 1;
-  bool kicked = false;
-
   /*
    CRYPTO GARBAGE BEGINS HERE ===========================================
   */
 
   yep::Crypto JEFF;
 
-  unsigned char key[32];
-  unsigned char iv[16];
-
-  OpenSSL_add_all_algorithms();
-
   RAND_bytes(key, 32);
-  RAND_bytes(iv,16);
-
-  std::cout << "this is the key: " << key << std::endl;
-  
-  // get that pubkey
-  EVP_PKEY *pubkey;
-  FILE* pubf = fopen("rsa_pub.pem","rb");
-  pubkey = PEM_read_PUBKEY(pubf,nullptr,nullptr,nullptr);
-
-  std::cout << key << std::endl;
 
   unsigned char encrypted_key[256];
   std::memset(encrypted_key, 0, 256);
   int encryptedkey_len = JEFF.rsa_encrypt(key, 32, pubkey, encrypted_key);
 
-  std::cout << encryptedkey_len << std::endl;
-
-  // send encrypted key to server
-  int len = sendto(sockfd, &encrypted_key, encryptedkey_len, 0, reinterpret_cast<sockaddr*>(&server), sin_size);
+  // send encrypted key to server, then our name in its own frame so it
+  // never runs into the first message
+  std::string hello(reinterpret_cast<char*>(encrypted_key), encryptedkey_len);
+  hello += frame::make(frame::control, (const unsigned char*)username.data(), username.size());
 
-  std::cout << len << std::fflush;
+  if (!frame::send_all(sockfd, hello.data(), hello.size())) {
+    std::cerr << "Error sending the key exchange" << std::endl;
+    close(sockfd);
+    return -1;
+  }
 
   /*
    END MY LIFE =======================================================
   */
 
-  std::cout << "Please enter a username" << std::endl;
-  std::getline(std::cin, username);
-  sendto(sockfd, username.c_str(), username.length(), 0, reinterpret_cast<sockaddr*>(&server), sin_size);
-
-  // Allocate space on the heap
-  ChatClient::thread *t = new ChatClient::thread;
-  std::memcpy(&t->socket, &sockfd, sizeof(int));
-  std::memcpy(&t->key, &key, 32);
-
-  
-  pthread_t child;
-  pthread_create(&child, nullptr, client_handler, t);
-  pthread_detach(child);
-
-  while (true) {
-    ChatClient::std_message s_message;
-    std::string message = handle_input();
+  return sockfd;
+}
 
-    if (message == "/quit\n" && !kicked) {
-      break;
-    }
+int ChatClient::RunClient() {
+  int port = handle_port();
+  in_addr_t host = handle_host();
 
-    unsigned char* plaintext = (unsigned char*)message.c_str();
+  // Ask up front, the server only gives the handshake a few seconds
+  std::cout << "Please enter a username" << std::endl;
+  std::string username = read_line();
 
-    unsigned char miv[16];
-    //RAND_bytes(miv, 16);
+  OpenSSL_add_all_algorithms();
 
-    std::memset(miv, 0, 16);
-    
-    unsigned char ciphertext[1024];
-    std::memset(ciphertext,0,1024);
-    int ciphertext_len = JEFF.encrypt(plaintext, message.size(), key, miv, ciphertext);
+  // get that pubkey
+  EVP_PKEY *pubkey = load_public_key("rsa_pub.pem");
+  if (pubkey == nullptr) {
+    std::cerr << "Failed to read rsa_pub.pem" << std::endl;
+    return EXIT_FAILURE;
+  }
 
-    send(sockfd, ciphertext, ciphertext_len, 0);
+  unsigned char key[32];
+  int sockfd = handshake(host, port, pubkey, username, key);
+  EVP_PKEY_free(pubkey);
+  if (sockfd < 0) {
+    return EXIT_FAILURE;
   }
 
-  close(sockfd);
+  std::cout << "You connected." << std::endl;
 
-  return EXIT_SUCCESS;
-}
+  // Everything from here on is one thread polling stdin and the socket
+  EventLoop loop;
+  Connection& conn = loop.add(std::unique_ptr<Connection>(new Connection(sockfd, key, username)));
 
-} // namespace client
+  conn.on_message = [](Connection&, const std::string& message) {
+    std::cout << " <<< " << message << "\n <<< " << std::endl;
+  };
+  conn.on_control = [this, &loop](Connection&, const std::string& message) {
+    if (message == "kicked") {
+      std::cout << "OHH HO HO HOOO YOU HAVE BEEN KICKED MY BOY" << std::endl;
+      this->kicked = true;
+      loop.stop();
+    }
+  };
+  bool quitting = false;
+  bool gone = false;
+  loop.on_close = [&](Connection&) {
+    if (!this->kicked) {
+      std::cout << "Server closed the connection" << std::endl;
+    }
+    gone = true;
+    loop.stop();
+  };
+
+  loop.watch_stdin(
+    [&](const std::string& message) {
+      if (quitting) {
+        return;
+      }
+      conn.send(message);
+      if (message == "/quit") {
+        quitting = true;
+        return;
+      }
+      std::cout << " >>> " << std::flush;
+    },
+    [&] { quitting = true; });
 
+  std::cout << " >>> " << std::flush;
+  while (!quitting && loop.run_once(-1)) {}
 
-int main() {
-  client::ChatClient cs;
-  cs.RunClient();
+  // Let a trailing /quit drain before the socket closes
+  while (!gone && !this->kicked && conn.want_write() && loop.run_once(1000)) {}
 
   return EXIT_SUCCESS;
 }
+
+} // namespace client
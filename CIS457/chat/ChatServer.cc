@@ -1,13 +1,18 @@
 #include "./include/ChatServer.hpp"
 
-#include "./include/Succ.hpp"
+#include "./include/Command.hpp"
 #include "./include/Crypto.hpp"
+#include "./include/Frame.hpp"
+#include "./include/Metrics.hpp"
+#include "./include/Admin.hpp"
+#include "./include/Bus.hpp"
+#include "./include/UringLoop.hpp"
 #include <cstdlib>
 #include <cstring>
 #include <algorithm>
 #include <cstdio>
+#include <thread>
 #include <fstream>
-#include <sstream>
 #include <iostream>
 #include <openssl/conf.h>
 #include <openssl/err.h>
@@ -15,166 +20,238 @@
 #include <openssl/pem.h>
 #include <openssl/rand.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <tuple>
 #include <unistd.h>
+#include <vector>
 
 
 namespace server {
 
-  std::pair<std::string, int> ChatServer::encrypt_string(std::string input, unsigned char key[32]) {
-    yep::Crypto JEFF;
-  unsigned char* plaintext = (unsigned char*)input.c_str();
-  unsigned char miv[16];
-  std::memset(miv, 0, 16);
-  unsigned char ciphertext[1024];
-  int ciphertext_len = JEFF.encrypt(plaintext, input.size(), key, miv, ciphertext);
-
-  std::string str( ciphertext, ciphertext + sizeof ciphertext / sizeof ciphertext[0] );
+void ChatServer::send_to(thread& user, frame::Type type, std::string_view message) {
+  std::string f;
+  {
+    metrics::Scope timer(metrics::encrypt);
+    user.session->seal(type, (const unsigned char*)message.data(), message.size(), f);
+  }
 
-  std::pair<std::string, int> result;
+  // Losing a rekey would leave the user unable to read the room
+  outbound->push(user.socket, std::make_shared<const std::string>(std::move(f)), type != frame::rekey);
+}
 
-  result.first = str;
-  result.second = ciphertext_len;
+void ChatServer::rotate_room_key() {
+  RAND_bytes(room_key, 32);
+  room.reset(new yep::Session(room_key, yep::Session::server));
 
-  return result;
+  const std::string key(reinterpret_cast<char*>(room_key), 32);
+  for (auto& user : users) {
+    send_to(user, frame::rekey, key);
+  }
 }
 
-void* ChatServer::server_handler(void* args) {
-  the::Succ SKOOMA_HIGH;
-  yep::Crypto JEFF;
-  ChatServer::std_message s;
-  ChatServer::thread t;
+void ChatServer::remove_user(int socket) {
+  std::string gone;
+  {
+    std::lock_guard<std::mutex> lock(users_lock);
 
-  RAND_bytes(s.iv, 16);
+    for (auto it = users.begin(); it != users.end(); ++it) {
+      if (it->socket == socket) {
+        gone = it->username;
+        users.erase(it);
 
-  std::memcpy(&t, args, sizeof(ChatServer::thread));
+        // Whoever left still has the old key
+        if (use_room_key) {
+          rotate_room_key();
+        }
+        break;
+      }
+    }
+  }
 
-  socklen_t sin_size = sizeof(t.client);
+  // Bus sends can block, never make them with users_lock held
+  if (bus != nullptr && !gone.empty()) {
+    bus->left(gone);
+  }
 
-  while (true) {
-    char data[4096];
-    std::memset(data, 0, sizeof(data));
-    int r = recv(t.socket, data, 4096, 0);
+  outbound->remove(socket);
+}
+
+void* ChatServer::server_handler(void* args) {
+  ChatServer::thread t = *static_cast<ChatServer::thread*>(args);
+  delete static_cast<ChatServer::thread*>(args);
 
+  frame::Type type;
+  std::string data;
+  std::string message;
 
-    if (r < 0) {
+  while (true) {
+    if (!frame::read(t.socket, type, data)) {
+      t.instance->remove_user(t.socket);
       break;
     }
 
-    if (std::string(data) == "/quit" || r < 0) {
-      std::cout << "Shutting down the server connection to user: " << t.username << std::endl;
+    if (!t.instance->receive(t, data, message)) {
+      t.instance->remove_user(t.socket);
       // Break this worker
       break;
     }
+  }
+  std::cout << "Closing handler thread" << std::endl;
+  return nullptr;
+}
 
-    /* crypto */
-    std::string message = std::string(data);
-    unsigned char* cipher = (unsigned char*) message.c_str();
-
-    unsigned char miv[16];
-    std::memset(miv, 0, 16);
+bool ChatServer::receive(thread& t, const std::string& payload, std::string& message) {
+  metrics::count(metrics::messages_in);
+  metrics::count(metrics::bytes_in, payload.size());
 
-    unsigned char decrypted_message[1024];
-    std::memset(decrypted_message, 0, 1024);
-    std::cout << "Got something: " << message << std::endl;
+  /* crypto */
+  bool opened;
+  {
+    metrics::Scope timer(metrics::decrypt);
+    opened = t.session->open(payload, message);
+  }
+  if (!opened) {
+    metrics::count(metrics::auth_failures);
+    std::cout << "Dropping " << t.username << ", message failed to authenticate" << std::endl;
+    return false;
+  }
 
-    std::cout << t.key << std::endl;
+  return handle_message(t, message);
+}
 
-    int fake = 16;
+bool ChatServer::handle_message(thread& t, const std::string& message) {
+  std::cout << " <<< " << t.username << ": " << message << std::endl;
 
-    if (message.size() > fake) {
-      fake = message.size();
-    }
+  // Views into message from here on, nothing below copies it
+  command::Tokens args{std::string_view(message)};
+  command::Id command = command::parse(args);
 
-    int message_len = JEFF.decrypt(
-          cipher,
-          fake,
-          t.key,
-          miv,
-          decrypted_message);
-    std::cout << " <<< " << t.username << ": " << decrypted_message << std::endl;
+  // Both enums follow command::Id
+  metrics::count(static_cast<metrics::Counter>(metrics::cmd_none + command));
+  metrics::Scope timer(static_cast<metrics::Timer>(metrics::dispatch_none + command));
 
-    std::cout << decrypted_message << std::endl;
+  if (command == command::quit) {
+    std::cout << "Shutting down the server connection to user: " << t.username << std::endl;
+    return false;
+  } else if (command == command::list) {
+    std::string outlist = "";
+    {
+      std::lock_guard<std::mutex> lock(t.instance->users_lock);
+      for (int i = 0; i < t.instance->users.size(); i++) {
+        outlist = outlist + "\n" + t.instance->users[i].username;
+      }
+    }
 
-    message = std::string((char *) decrypted_message);
+    // Plus whoever is on the other worker processes
+    if (t.instance->bus != nullptr) {
+      std::vector<std::string> remote;
+      t.instance->bus->remote_names(remote);
+      for (const auto& name : remote) {
+        outlist = outlist + "\n" + name;
+      }
+    }
 
-    std::string command = t.instance->extract_command(message);
+    // Other threads seal with this session under users_lock, so we do too
+    {
+      std::lock_guard<std::mutex> lock(t.instance->users_lock);
+      t.instance->send_to(t, frame::direct, outlist);
+    }
 
-    std::cout << "Command:(" + command + ")" << std::endl;
+  } else if (command == command::broadcast) {
+    std::string_view body = args.remainder();
+    if (body.empty()) {
+      return true;
+    }
 
-    std::vector<std::string> command_args;
-    std::istringstream iss(message);
+    std::cout << "Sending broadcast packet" << std::endl;
+    t.instance->deliver_broadcast(body);
+    if (t.instance->bus != nullptr) {
+      t.instance->bus->broadcast(body);
+    }
+  } else if (command == command::pm) {
+    std::string_view who = args.next();
+    std::string_view body = args.remainder();
+    if (who.empty() || body.empty()) {
+      return true;
+    }
 
-    for(std::string message; iss >> message; ) {
-      command_args.push_back(message);
+    std::cout << "Sending personal message" << std::endl;
+    t.instance->deliver_pm(who, body);
+    if (t.instance->bus != nullptr) {
+      t.instance->bus->pm(who, body);
     }
+  } else if (command == command::kick) {
+    // Kicking goes through the admin socket now, see Admin.hpp
+    std::cout << "access denied" << std::endl;
+    std::lock_guard<std::mutex> lock(t.instance->users_lock);
+    t.instance->send_to(t, frame::direct, "Kicking is done from the server's admin socket");
+  }
 
-    std::cout << "args: " << command_args.size() << std::endl;
+  return true;
+}
 
-    std::string outgoing;
+void ChatServer::deliver_broadcast(std::string_view body) {
+  metrics::Scope timer(metrics::broadcast_fanout);
+  std::lock_guard<std::mutex> lock(users_lock);
+  history.add(body);
+
+  if (use_room_key) {
+    // Everyone holds the room key, so one encryption covers the room
+    std::string f;
+    {
+      metrics::Scope seal_timer(metrics::encrypt);
+      room->seal(frame::group, (const unsigned char*)body.data(), body.size(), f);
+    }
+    SendQueue::frame_ptr shared = std::make_shared<const std::string>(std::move(f));
 
-    if (command.substr(0, 4) == "list") {
-      std::string outlist = "";
+    for (int i = 0; i < users.size(); ++i) {
+      outbound->push(users[i].socket, shared);
+    }
+  } else {
+    for (int i = 0; i < users.size(); ++i) {
+      send_to(users[i], frame::direct, body);
+    }
+  }
+}
 
-      for (int i = 0; i < t.instance->users.size(); i++) {
-        outlist = outlist + "\n" + t.instance->users[i].username;
-      }
+void ChatServer::deliver_pm(std::string_view who, std::string_view body) {
+  std::lock_guard<std::mutex> lock(users_lock);
 
-      std::pair<std::string, int> out = t.instance->encrypt_string(outlist, t.key);
-      send(t.socket, out.first.c_str(), out.second, 0);
+  for (int i = 0; i < users.size(); ++i) {
+    if (users[i].username == who) {
+      send_to(users[i], frame::direct, body);
+    }
+  }
+}
 
-    } else if (command == "broadcast") {
-      std::cout << "Sending broadcast packet" << std::endl;
+void ChatServer::kick_user(std::string_view who) {
+  std::unique_lock<std::mutex> lock(users_lock);
 
-      for (int i = 0; i < t.instance->users.size(); ++i) {
-        std::cout << "sending to " + t.instance->users[i].username + ": " + command_args[1] << std::endl;
+  const std::string kick_msg("kicked");
+  SendQueue::frame_ptr f = std::make_shared<const std::string>(frame::make(
+      frame::control,
+      reinterpret_cast<const unsigned char*>(kick_msg.data()),
+      kick_msg.size()));
 
-  std::pair<std::string, int> out = t.instance->encrypt_string(command_args[1], t.instance->users[i].key);
+  for (int i = 0; i < users.size(); ++i) {
+    if (users[i].username == who) {
+      std::cout << "Bye Felicia!" << std::endl;
+      outbound->push(users[i].socket, f, false);
+      users.erase(users.begin() + i);
 
-        send(t.instance->users[i].socket, out.first.c_str(), out.second, 0);
+      // The kicked user must not be able to read what comes next
+      if (use_room_key) {
+        rotate_room_key();
       }
-    } else if (command == "pm") {
-      std::cout << "Sending personal message" << std::endl;
-
-      for (int i = 0; i < t.instance->users.size(); ++i) {
-        std::cout << "username1 = " + t.instance->users[i].username << std::endl;
-        std::cout << "username2 = " + command_args[1] << std::endl;
-        if (t.instance->users[i].username == command_args[1]) {
-    std::pair<std::string, int> out = t.instance->encrypt_string(command_args[2], t.instance->users[i].key);
 
-    send(t.instance->users[i].socket, out.first.c_str(), out.second, 0);
-  }
-      }
-    } else if (command == "kick") {
-      std::string pass = "";
-
-      if (t.instance->check_admin(command_args[2])) {
-        std::string who = command_args[1];
-
-        std::string kick_msg("kicked");
-
-        for (int i = 0; i < t.instance->users.size(); ++i) {
-          if (t.instance->users[i].username == who) {
-            std::cout << "Bye Felicia!" << std::endl;
-            // Encrypt our kick message
-            ChatServer::std_message sm;
-            //RAND_pseudo_bytes(sm.iv, 16);
-            //sm.cipher = SKOOMA_HIGH.encrypt(cs.getUsers()[i].key, sm.iv, kick_msg);
-            send(t.instance->users[i].socket, kick_msg.c_str(), kick_msg.length(), 0);
-            t.instance->users.erase(t.instance->users.begin() + i);
-          }
-        }
-      } else {
-        std::cout << "access denied" << std::endl;
+      lock.unlock();
+      if (bus != nullptr) {
+        bus->left(who);
       }
+      break;
     }
   }
-  std::cout << "Closing handler thread" << std::endl;
-  return nullptr;
-}
-
-bool ChatServer::check_admin(const std::string& pass) {
-  return pass == admin_password;
 }
 
 int ChatServer::handle_port() {
@@ -194,17 +271,9 @@ std::string ChatServer::handle_input(std::string prompt = " >>> ") {
 }
 
 void ChatServer::broadcast(const std::string& message) {
-  the::Succ succ;
-  for (const auto &user : this->users) {
-    ChatServer::std_message outgoing;
-    //RAND_pseudo_bytes(outgoing.iv, 16);
-    /*outgoing.cipher = succ.encrypt(
-        const_cast<unsigned char*>(reinterpret_cast<const unsigned char*>(user.key)),
-        outgoing.iv,
-        message);
-    */
-
-    send(user.socket, message.c_str(), sizeof(ChatServer::std_message), 0);
+  std::lock_guard<std::mutex> lock(users_lock);
+  for (auto &user : this->users) {
+    send_to(user, frame::direct, message);
   }
 }
 
@@ -222,121 +291,340 @@ void ChatServer::list_users() {
   std::cout << "No clients found." << std::endl;
 }
 
-std::string ChatServer::extract_command(const std::string& input) const {
-  std::string command = "no_command";
-  for (const auto v : input) {
-    if  (v == '/') {
-      // Strips everything before the command delimeter
-      command = input.substr(input.find('/') + 1, input.find(' ')-1);
+void ChatServer::handshake(const pending_handshake& pending) {
+  metrics::Scope timer(metrics::handshake);
+  yep::Crypto JEFF;
+  int clientsocket = pending.socket;
+  bool prefetched = !pending.hello.empty();
+
+  // Nobody gets to park a handshake worker forever
+  timeval timeout;
+  timeout.tv_sec = HANDSHAKE_TIMEOUT;
+  timeout.tv_usec = 0;
+  if (!prefetched) {
+    setsockopt(clientsocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+
+  /*
+    CRYPTO
+  */
+
+  unsigned char encrypted_key[256];
+  unsigned char decrypted_key[256];
+
+  // receive encrypted key, unless the io_uring loop already did
+  bool have_key = prefetched;
+  if (prefetched) {
+    std::memcpy(encrypted_key, pending.hello.data(), 256);
+  } else {
+    have_key = frame::recv_all(clientsocket, reinterpret_cast<char*>(encrypted_key), 256);
+  }
+
+  int decryptedkey_len = -1;
+  if (have_key) {
+    metrics::Scope rsa_timer(metrics::rsa_decrypt);
+    decryptedkey_len = JEFF.rsa_decrypt(encrypted_key, 256, this->privkey, decrypted_key);
+  }
+
+  if (decryptedkey_len != 32) {
+    std::cerr << "Key exchange failed, killing session" << std::endl;
+    reject_handshake(clientsocket);
+    return;
+  }
+
+  /*
+    END
+  */
+
+  // Get username, it comes framed so it can't swallow the first message
+  frame::Type type;
+  std::string username;
+  bool have_name;
+  if (prefetched) {
+    size_t offset = 256;
+    bool bad;
+    have_name = frame::next(pending.hello, offset, type, username, bad);
+  } else {
+    have_name = frame::read(clientsocket, type, username);
+  }
+
+  if (!have_name || type != frame::control
+      || username.empty() || username.size() >= MAX_USERNAME) {
+    const std::string err = "Failed to get username, exiting";
+    send(clientsocket, err.c_str(), err.length(), MSG_NOSIGNAL);
+    std::cerr << "Failed to get username, killing session" << std::endl;
+    reject_handshake(clientsocket);
+    return;
+  }
+
+  // Handshake is done, the handler blocks on reads for as long as it likes
+  if (!prefetched) {
+    timeout.tv_sec = 0;
+    setsockopt(clientsocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
 
-      command.erase(std::remove(command.begin(), command.end(), '\n'), command.end());
+  pthread_t client_r;
+  thread* t = new thread();
+  t->socket = clientsocket;
+  t->username = username;
+  t->client = pending.client;
+  memcpy(t->key, &decrypted_key, decryptedkey_len);
+  t->session = std::make_shared<yep::Session>(t->key, yep::Session::server);
+  t->instance = this;
+
+  std::cout << "username: " << t->username << std::endl;
+  std::cout << "sockID: " << t->socket << std::endl;
+  // Add the user to our global ref
+  {
+    std::lock_guard<std::mutex> lock(this->users_lock);
+    this->users.push_back(*t);
+    this->outbound->add(clientsocket);
+
+    // Catch the newcomer up, the whole backlog goes out as one write.
+    // Only the newest messages that fit under the send limit go, leaving
+    // room for the rekey below, so joining never trips the slow client
+    // policy. The views for_each hands out only last for the call, so one
+    // pass picks the messages and a second seals them.
+    if (this->history.size() > 0) {
+      std::vector<size_t> sizes;
+      this->history.for_each([&](std::string_view m) { sizes.push_back(m.size()); });
+
+      const size_t per_frame = frame::HEADER_SIZE + yep::Session::OVERHEAD;
+      size_t budget = this->outbound->limit();
+      budget = budget > per_frame + 32 ? budget - per_frame - 32 : 0;
+
+      size_t first = sizes.size();
+      while (first > 0 && per_frame + sizes[first - 1] <= budget) {
+        budget -= per_frame + sizes[first - 1];
+        --first;
+      }
+
+      std::string backlog;
+      size_t i = 0;
+      this->history.for_each([&](std::string_view m) {
+        if (i++ >= first) {
+          metrics::Scope seal_timer(metrics::encrypt);
+          t->session->seal(frame::direct, (const unsigned char*)m.data(), m.size(), backlog);
+        }
+      });
+      if (!backlog.empty()) {
+        this->outbound->push(clientsocket, std::make_shared<const std::string>(std::move(backlog)), false);
+      }
+    }
 
-      return command;
+    // New member needs the key, and a rotation keeps them out of old traffic
+    if (this->use_room_key) {
+      rotate_room_key();
     }
-    return command;
   }
+
+  metrics::count(metrics::handshakes);
+  if (this->bus != nullptr) {
+    this->bus->joined(t->username);
+  }
+
+  if (this->uring != nullptr) {
+    this->uring->joined(t);
+    return;
+  }
+
+  pthread_create(&client_r, nullptr, ChatServer::server_handler, t);
+  pthread_detach(client_r);
 }
 
-int ChatServer::RunServer() {
-  the::Succ sad;
-  yep::Crypto JEFF;
-  int sock = socket(AF_INET, SOCK_STREAM, 0);
+void ChatServer::reject_handshake(int socket) {
+  metrics::count(metrics::handshake_failures);
 
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = INADDR_ANY;
-  addr.sin_port = htons(handle_port());
+  // The io_uring loop still has reads armed on it, let it do the closing
+  if (this->uring != nullptr) {
+    this->uring->rejected(socket);
+    return;
+  }
 
-  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    std::cout << "Failed to bind socket." << std::endl;
-    return EXIT_FAILURE;
+  close(socket);
+}
+
+bool ChatServer::offer_handshake(pending_handshake pending) {
+  {
+    std::lock_guard<std::mutex> lock(this->handshake_lock);
+    if (this->handshakes.size() >= MAX_PENDING_HANDSHAKES) {
+      return false;
+    }
+    this->handshakes.push_back(std::move(pending));
   }
+  this->handshake_ready.notify_one();
 
-  // listen for a new client connection
-  listen(sock, 10);
+  return true;
+}
+
+void* ChatServer::handshake_worker(void* args) {
+  ChatServer* cs = static_cast<ChatServer*>(args);
 
   while (true) {
-    sockaddr_in client;
-    socklen_t sin_size = sizeof(client);
-    std::cout << "Waiting for connection..." << std::endl;
-    int clientsocket = accept(sock, reinterpret_cast<sockaddr*>(&client), &sin_size);
-    if (clientsocket > -1) {
-      std::cout << "Client conected" << std::endl;
-    } else {
-      std::cout << "Error, failed to connect client" << std::endl;
+    pending_handshake next;
+    {
+      std::unique_lock<std::mutex> lock(cs->handshake_lock);
+      cs->handshake_ready.wait(lock, [cs] { return !cs->handshakes.empty(); });
+      next = cs->handshakes.front();
+      cs->handshakes.pop_front();
     }
+    cs->handshake_space.notify_one();
 
+    cs->handshake(next);
+  }
 
-    char data[this->MAXDATASIZE];
-    std::cout << "Server now accepting connections" << std::endl;
+  return nullptr;
+}
 
+int ChatServer::fork_workers(size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      return static_cast<int>(i);
+    }
+    if (pid < 0) {
+      std::cerr << "Failed to start worker " << i << std::endl;
+    }
+  }
 
-    /*
-      CRYPTO
-    */
+  // The parent just sticks around until the workers are gone
+  int status;
+  pid_t pid;
+  while ((pid = wait(&status)) > 0) {
+    std::cout << "Worker process " << pid << " exited" << std::endl;
+  }
 
-    unsigned char encrypted_key[256];
+  return -1;
+}
 
-    // get that privkey
-    EVP_PKEY *privkey;
-    FILE *privf = fopen("rsa_priv.pem", "rb");
-    privkey = PEM_read_PrivateKey(privf, nullptr, nullptr, nullptr);
-    unsigned char decrypted_key[32];
+int ChatServer::RunServer() {
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(handle_port());
 
-    // receive encrypted key
+  this->use_room_key = handle_input("Encrypt broadcasts once with a shared room key? [y/N]: ") == "y";
+  bool use_uring = handle_input("Networking backend? [threads/uring]: ") == "uring";
+
+  std::string limit = handle_input("Per client send queue limit in KB [256]: ");
+  size_t high_water = (limit.empty() ? 256 : std::stoul(limit)) * 1024;
+  SendQueue::Policy policy = handle_input("Drop messages to slow clients or disconnect them? [drop/disconnect]: ") == "disconnect"
+    ? SendQueue::disconnect
+    : SendQueue::drop;
+  std::string procs = handle_input("Worker processes sharing the port [1]: ");
+  size_t processes = std::max<size_t>(1, procs.empty() ? 1 : std::stoul(procs));
+
+  // get that privkey, once
+  FILE *privf = fopen("rsa_priv.pem", "rb");
+  if (privf == nullptr) {
+    std::cerr << "Failed to open rsa_priv.pem" << std::endl;
+    return EXIT_FAILURE;
+  }
+  this->privkey = PEM_read_PrivateKey(privf, nullptr, nullptr, nullptr);
+  fclose(privf);
+  if (this->privkey == nullptr) {
+    std::cerr << "Failed to read the private key" << std::endl;
+    return EXIT_FAILURE;
+  }
 
+  // Each worker gets its own listening socket and the kernel spreads
+  // connections over them
+  std::unique_ptr<Bus> workers_bus;
+  if (processes > 1) {
+    workers_bus.reset(new Bus(processes));
+    int index = fork_workers(processes);
+    if (index < 0) {
+      EVP_PKEY_free(this->privkey);
+      return EXIT_SUCCESS;
+    }
+    workers_bus->attach(index);
+    this->bus = workers_bus.get();
+    std::cout << "Worker " << index << " is pid " << getpid() << std::endl;
+  }
 
+  // After the fork, the queue's wake pipe must not be shared
+  this->outbound.reset(new SendQueue(high_water, policy, use_uring));
 
-    recv(clientsocket, &encrypted_key, 256, 0);
-    //encrypted_key[256] = '\0';
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (processes > 1) {
+    int one = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  }
 
-    int decryptedkey_len = JEFF.rsa_decrypt(encrypted_key, 256, privkey, decrypted_key);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    std::cout << "Failed to bind socket." << std::endl;
+    return EXIT_FAILURE;
+  }
 
-    decrypted_key[decryptedkey_len] = '\0';
+  // listen for a new client connection
+  listen(sock, SOMAXCONN);
 
-    std::cout << "this the decrypted key: " << decrypted_key << std::endl;
+  if (this->bus != nullptr) {
+    this->bus->start(this);
+  }
 
+  // One admin socket per worker, stats are per process
+  std::string admin_path = this->bus != nullptr
+    ? "chat_admin." + std::to_string(this->bus->worker()) + ".sock"
+    : "chat_admin.sock";
+  Admin admin(this, admin_path);
+  if (admin.start()) {
+    std::cout << "Admin socket at " << admin_path << std::endl;
+  } else {
+    std::cerr << "Failed to open the admin socket at " << admin_path << std::endl;
+  }
 
+  // RSA decryption is the slow part of a join, spread it over the cores
+  // this process gets
+  unsigned int workers = std::max(2u, std::thread::hardware_concurrency() / static_cast<unsigned int>(processes));
+  for (unsigned int i = 0; i < workers; ++i) {
+    pthread_t worker;
+    pthread_create(&worker, nullptr, ChatServer::handshake_worker, this);
+    pthread_detach(worker);
+  }
 
+  if (use_uring) {
+    UringLoop loop(this, sock);
+    if (loop.init()) {
+      this->uring = &loop;
+      std::cout << "Server now accepting connections (io_uring)" << std::endl;
+      loop.run();
+      return EXIT_FAILURE;
+    }
 
-    /*
-      END
-    */
+    std::cout << "io_uring is not available here, falling back to threads" << std::endl;
+    this->outbound.reset(new SendQueue(high_water, policy));
+  }
 
-    // Get username
-    char username[100];
-    std::memset(username, 0, sizeof(username));
-    int r = recv(clientsocket, username, 100, 0);
-    if  (r < 0) {
-      const std::string err = "Failed to get username, exiting";
-      send(clientsocket, err.c_str(), err.length(), 0);
-      std::cerr << "Failed to get username, killing session" << std::endl;
-      close(clientsocket);
-    }
+  pthread_t flusher;
+  pthread_create(&flusher, nullptr, SendQueue::flusher, this->outbound.get());
+  pthread_detach(flusher);
 
-    char actual_name[r];
-    std::strcpy(actual_name, username);
-
-    pthread_t client_r;
-    thread* t = new thread();
-    t->socket = clientsocket;
-    t->username = std::string(actual_name);
-    t->client = client;
-    memcpy(t->key, &decrypted_key, decryptedkey_len);
-    t->instance = this;
-
-    std::cout << "len: " << r << std::endl;
-    std::cout << "key: " << t->key << std::endl;
-    std::cout << "username: " << t->username << std::endl;
-    std::cout << "sockID: " << t->socket << std::endl;
-    // Add the user to our global ref
-    this->users.push_back(*t);
+  std::cout << "Server now accepting connections" << std::endl;
 
-    pthread_create(&client_r, nullptr, ChatServer::server_handler, t);
-    pthread_detach(client_r);
+  while (true) {
+    sockaddr_in client;
+    socklen_t sin_size = sizeof(client);
+    int clientsocket = accept(sock, reinterpret_cast<sockaddr*>(&client), &sin_size);
+    if (clientsocket < 0) {
+      std::cout << "Error, failed to connect client" << std::endl;
+      continue;
+    }
 
+    std::cout << "Client conected" << std::endl;
+
+    // When every worker is busy and the queue is full we stop accepting and
+    // let the listen backlog hold the rest
+    std::unique_lock<std::mutex> lock(this->handshake_lock);
+    this->handshake_space.wait(lock, [this] {
+      return this->handshakes.size() < MAX_PENDING_HANDSHAKES;
+    });
+    this->handshakes.push_back({clientsocket, client, ""});
+    lock.unlock();
+    this->handshake_ready.notify_one();
   }
 
+  EVP_PKEY_free(this->privkey);
 
   return EXIT_SUCCESS;
 }
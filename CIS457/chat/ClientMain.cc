@@ -0,0 +1,10 @@
+#include "./include/ChatClient.hpp"
+
+#include <cstdlib>
+
+int main() {
+  client::ChatClient cs;
+  cs.RunClient();
+
+  return EXIT_SUCCESS;
+}
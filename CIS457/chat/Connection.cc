@@ -0,0 +1,102 @@
+#include "./include/Connection.hpp"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace client {
+
+Connection::Connection(int socket, const unsigned char key[32], std::string name)
+  : socket(socket), username(std::move(name)), session(key, yep::Session::client) {
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+}
+
+Connection::~Connection() {
+  close(socket);
+}
+
+bool Connection::send(std::string_view message) {
+  bool was_idle = !want_write();
+  session.seal(frame::direct, (const unsigned char*)message.data(), message.size(), outbuf);
+
+  // Otherwise the loop is already waiting for the socket to drain
+  return was_idle ? flush() : true;
+}
+
+bool Connection::flush() {
+  while (out_offset < outbuf.size()) {
+    ssize_t sent = ::send(socket, outbuf.data() + out_offset, outbuf.size() - out_offset,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    out_offset += sent;
+  }
+
+  outbuf.clear();
+  out_offset = 0;
+  return true;
+}
+
+bool Connection::on_readable() {
+  char buf[65536];
+
+  while (true) {
+    ssize_t r = recv(socket, buf, sizeof(buf), MSG_DONTWAIT);
+    if (r == 0) {
+      return false;
+    }
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return false;
+    }
+    inbuf.append(buf, r);
+  }
+
+  size_t offset = 0;
+  frame::Type type;
+  bool bad = false;
+  while (frame::next(inbuf, offset, type, payload, bad)) {
+    dispatch(type);
+  }
+  inbuf.erase(0, offset);
+
+  return !bad;
+}
+
+void Connection::dispatch(frame::Type type) {
+  if (type == frame::control) {
+    if (on_control) {
+      on_control(*this, payload);
+    }
+    return;
+  }
+
+  // Decrypt our message
+  yep::Session* s = type == frame::group ? room.get() : &session;
+  if (s == nullptr || !s->open(payload, plaintext)) {
+    return;
+  }
+
+  if (type == frame::rekey) {
+    if (plaintext.size() == 32) {
+      room.reset(new yep::Session((const unsigned char*)plaintext.data(), yep::Session::client));
+    }
+    return;
+  }
+
+  if (on_message) {
+    on_message(*this, plaintext);
+  }
+}
+
+} // namespace client
@@ -46,8 +46,12 @@ int yep::Crypto::rsa_decrypt(unsigned char* in, size_t inlen, EVP_PKEY *key, uns
     handleErrors();
   if (EVP_PKEY_decrypt(ctx, nullptr, &outlen, in, inlen) <= 0)
     handleErrors();
-  if (EVP_PKEY_decrypt(ctx, out, &outlen, in, inlen) <= 0)
-    handleErrors();
+  // Garbage from a client is not worth taking the server down for
+  if (EVP_PKEY_decrypt(ctx, out, &outlen, in, inlen) <= 0) {
+    EVP_PKEY_CTX_free(ctx);
+    return -1;
+  }
+  EVP_PKEY_CTX_free(ctx);
   return outlen;
 }
 
@@ -57,16 +61,6 @@ int yep::Crypto::encrypt(unsigned char *plaintext, int plaintext_len, unsigned c
   int len;
   int ciphertext_len;
 
-
-
-  using namespace std;
-
-  cout << "\n\nPlaintext: " << plaintext << endl;
-  cout << "Length of plain: " << plaintext_len << endl;
-  cout << "iv: " << iv << endl;
-  cout << "Key: " << key << endl << endl;
-
-  
   if(!(ctx = EVP_CIPHER_CTX_new())) handleErrors();
   if(1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key, iv))
     handleErrors();
@@ -77,9 +71,6 @@ int yep::Crypto::encrypt(unsigned char *plaintext, int plaintext_len, unsigned c
   ciphertext_len += len;
   EVP_CIPHER_CTX_free(ctx);
 
-  cout << "Ciphertext: " << ciphertext << endl;
-  cout << "C len: " << ciphertext_len << endl;
-  
   return ciphertext_len;
 }
 
@@ -89,15 +80,6 @@ int yep::Crypto::decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned
   int len;
   int plaintext_len;
 
-  using namespace std;
-
-  cout << "\n\nCiphertext: " << ciphertext << endl;
-  cout << "Length of cipher: " << ciphertext_len << endl;
-  cout << "iv: " << iv << endl;
-  cout << "Key: " << key << endl;
-
-  
-  std::cout << "Hey" << std::endl;
   if(!(ctx = EVP_CIPHER_CTX_new())) handleErrors();
   if(1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr, key, iv))
     handleErrors();
@@ -108,8 +90,103 @@ int yep::Crypto::decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned
   plaintext_len += len;
   EVP_CIPHER_CTX_free(ctx);
 
-  cout << "Plaintext: " << plaintext << endl;
-  cout << "P len: " << plaintext_len << endl;
-  
   return plaintext_len;
 }
+
+yep::Session::Session(const unsigned char key[32], Role role) {
+  const unsigned char to_server[4] = {'C', '2', 'S', 0};
+  const unsigned char to_client[4] = {'S', '2', 'C', 0};
+
+  std::memcpy(send_prefix, role == client ? to_server : to_client, 4);
+  std::memcpy(recv_prefix, role == client ? to_client : to_server, 4);
+
+  if(!(enc = EVP_CIPHER_CTX_new())) handleErrors();
+  if(!(dec = EVP_CIPHER_CTX_new())) handleErrors();
+
+  // Key schedule happens here, once per connection
+  if(1 != EVP_EncryptInit_ex(enc, EVP_aes_256_gcm(), nullptr, key, nullptr))
+    handleErrors();
+  if(1 != EVP_DecryptInit_ex(dec, EVP_aes_256_gcm(), nullptr, key, nullptr))
+    handleErrors();
+}
+
+yep::Session::~Session() {
+  EVP_CIPHER_CTX_free(enc);
+  EVP_CIPHER_CTX_free(dec);
+}
+
+void yep::Session::handleErrors() {
+  std::cerr << "Failed to perform OpenSSL operation" << std::endl;
+  ERR_print_errors_fp(stderr);
+  abort();
+}
+
+static void make_nonce(const unsigned char prefix[4], uint64_t counter, unsigned char nonce[12]) {
+  std::memcpy(nonce, prefix, 4);
+  for (int i = 0; i < 8; ++i) {
+    nonce[4 + i] = static_cast<unsigned char>(counter >> (56 - 8 * i));
+  }
+}
+
+void yep::Session::seal(frame::Type type, const unsigned char* plaintext, size_t len, std::string& out) {
+  unsigned char nonce[12];
+  uint64_t counter = send_counter++;
+  make_nonce(send_prefix, counter, nonce);
+
+  // Reserve the whole frame up front and encrypt in place
+  size_t start = out.size();
+  out.resize(start + frame::HEADER_SIZE + OVERHEAD + len);
+  unsigned char* dst = reinterpret_cast<unsigned char*>(&out[start]);
+
+  frame::write_header(dst, type, OVERHEAD + len);
+  std::memcpy(dst + frame::HEADER_SIZE, nonce + 4, 8);
+
+  unsigned char* ciphertext = dst + frame::HEADER_SIZE + 8;
+  int outlen;
+  if(1 != EVP_EncryptInit_ex(enc, nullptr, nullptr, nullptr, nonce))
+    handleErrors();
+  if(1 != EVP_EncryptUpdate(enc, ciphertext, &outlen, plaintext, len))
+    handleErrors();
+  if(1 != EVP_EncryptFinal_ex(enc, ciphertext + outlen, &outlen))
+    handleErrors();
+  if(1 != EVP_CIPHER_CTX_ctrl(enc, EVP_CTRL_GCM_GET_TAG, 16, ciphertext + len))
+    handleErrors();
+}
+
+bool yep::Session::open(const std::string& payload, std::string& plaintext) {
+  if (payload.size() < OVERHEAD) {
+    return false;
+  }
+
+  const unsigned char* in = reinterpret_cast<const unsigned char*>(payload.data());
+  uint64_t counter = 0;
+  for (int i = 0; i < 8; ++i) {
+    counter = (counter << 8) | in[i];
+  }
+
+  if (counter < recv_counter) {
+    return false;
+  }
+
+  unsigned char nonce[12];
+  make_nonce(recv_prefix, counter, nonce);
+
+  size_t len = payload.size() - OVERHEAD;
+  plaintext.resize(len);
+  unsigned char* out = reinterpret_cast<unsigned char*>(&plaintext[0]);
+  unsigned char tag[16];
+  std::memcpy(tag, in + 8 + len, 16);
+
+  int outlen;
+  if(1 != EVP_DecryptInit_ex(dec, nullptr, nullptr, nullptr, nonce))
+    return false;
+  if(1 != EVP_DecryptUpdate(dec, out, &outlen, in + 8, len))
+    return false;
+  if(1 != EVP_CIPHER_CTX_ctrl(dec, EVP_CTRL_GCM_SET_TAG, 16, tag))
+    return false;
+  if(1 != EVP_DecryptFinal_ex(dec, out + outlen, &outlen))
+    return false;
+
+  recv_counter = counter + 1;
+  return true;
+}
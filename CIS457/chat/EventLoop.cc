@@ -0,0 +1,104 @@
+#include "./include/EventLoop.hpp"
+
+#include <cerrno>
+#include <unistd.h>
+
+namespace client {
+
+Connection& EventLoop::add(std::unique_ptr<Connection> conn) {
+  conns.push_back(std::move(conn));
+  return *conns.back();
+}
+
+void EventLoop::watch_stdin(std::function<void(const std::string&)> on_line, std::function<void()> on_eof) {
+  this->on_line = std::move(on_line);
+  this->on_eof = std::move(on_eof);
+  stdin_open = true;
+}
+
+void EventLoop::run() {
+  while (run_once(-1)) {}
+}
+
+bool EventLoop::run_once(int timeout_ms) {
+  if (!running || (conns.empty() && !stdin_open)) {
+    return false;
+  }
+
+  // Slot 0 is always stdin, poll skips it while it's -1
+  fds.resize(conns.size() + 1);
+  fds[0] = {stdin_open ? STDIN_FILENO : -1, POLLIN, 0};
+  for (size_t i = 0; i < conns.size(); ++i) {
+    short events = POLLIN;
+    if (conns[i]->want_write()) {
+      events |= POLLOUT;
+    }
+    fds[i + 1] = {conns[i]->fd(), events, 0};
+  }
+
+  if (poll(fds.data(), fds.size(), timeout_ms) < 0) {
+    return errno == EINTR;
+  }
+
+  if (fds[0].revents) {
+    read_stdin();
+  }
+
+  // Backwards, so dropping one only moves an entry we already looked at
+  for (size_t i = conns.size(); i-- > 0;) {
+    short revents = fds[i + 1].revents;
+    if (revents == 0) {
+      continue;
+    }
+
+    bool alive = true;
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+      alive = conns[i]->on_readable();
+    }
+    if (alive && (revents & POLLOUT)) {
+      alive = conns[i]->on_writable();
+    }
+
+    if (!alive) {
+      drop(i);
+    }
+  }
+
+  return running;
+}
+
+void EventLoop::read_stdin() {
+  char buf[4096];
+  ssize_t r = read(STDIN_FILENO, buf, sizeof(buf));
+  if (r < 0 && errno == EINTR) {
+    return;
+  }
+
+  if (r <= 0) {
+    stdin_open = false;
+    if (on_eof) {
+      on_eof();
+    }
+    return;
+  }
+  stdin_buf.append(buf, r);
+
+  size_t start = 0;
+  size_t end;
+  while ((end = stdin_buf.find('\n', start)) != std::string::npos) {
+    on_line(stdin_buf.substr(start, end - start));
+    start = end + 1;
+  }
+  stdin_buf.erase(0, start);
+}
+
+void EventLoop::drop(size_t i) {
+  if (on_close) {
+    on_close(*conns[i]);
+  }
+
+  conns[i] = std::move(conns.back());
+  conns.pop_back();
+}
+
+} // namespace client
@@ -0,0 +1,104 @@
+#include "./include/Frame.hpp"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+
+namespace frame {
+
+void write_header(unsigned char* dst, Type type, uint32_t len) {
+  uint32_t be_len = htonl(len);
+
+  std::memcpy(dst, &be_len, sizeof(be_len));
+  dst[4] = static_cast<unsigned char>(type);
+}
+
+std::string make(Type type, const unsigned char* payload, size_t len) {
+  std::string out(HEADER_SIZE + len, '\0');
+
+  write_header(reinterpret_cast<unsigned char*>(&out[0]), type, len);
+  if (len > 0) {
+    std::memcpy(&out[HEADER_SIZE], payload, len);
+  }
+
+  return out;
+}
+
+bool recv_all(int socket, char* buf, size_t len) {
+  size_t got = 0;
+  while (got < len) {
+    ssize_t r = recv(socket, buf + got, len - got, 0);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    got += r;
+  }
+
+  return true;
+}
+
+bool read(int socket, Type& type, std::string& payload) {
+  char header[HEADER_SIZE];
+  if (!recv_all(socket, header, HEADER_SIZE)) {
+    return false;
+  }
+
+  uint32_t be_len;
+  std::memcpy(&be_len, header, sizeof(be_len));
+  uint32_t len = ntohl(be_len);
+  if (len > MAX_PAYLOAD) {
+    return false;
+  }
+
+  type = static_cast<Type>(header[4]);
+  payload.resize(len);
+
+  return len == 0 || recv_all(socket, &payload[0], len);
+}
+
+bool next(const std::string& buffer, size_t& offset, Type& type, std::string& payload, bool& bad) {
+  bad = false;
+  if (buffer.size() - offset < HEADER_SIZE) {
+    return false;
+  }
+
+  uint32_t be_len;
+  std::memcpy(&be_len, buffer.data() + offset, sizeof(be_len));
+  uint32_t len = ntohl(be_len);
+  if (len > MAX_PAYLOAD) {
+    bad = true;
+    return false;
+  }
+
+  if (buffer.size() - offset - HEADER_SIZE < len) {
+    return false;
+  }
+
+  type = static_cast<Type>(buffer[offset + 4]);
+  payload.assign(buffer, offset + HEADER_SIZE, len);
+  offset += HEADER_SIZE + len;
+
+  return true;
+}
+
+bool send_all(int socket, const char* data, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t s = send(socket, data + sent, len - sent, MSG_NOSIGNAL);
+    if (s < 0 && errno == EINTR) {
+      continue;
+    }
+    if (s <= 0) {
+      return false;
+    }
+    sent += s;
+  }
+
+  return true;
+}
+
+} // namespace frame
@@ -0,0 +1,51 @@
+#include "./include/History.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace server {
+
+History::History(size_t capacity) : ring(capacity) {}
+
+void History::copy_in(size_t pos, const char* src, size_t len) {
+  size_t first = std::min(len, ring.size() - pos);
+  std::memcpy(ring.data() + pos, src, first);
+  std::memcpy(ring.data(), src + first, len - first);
+}
+
+void History::copy_out(size_t pos, char* dst, size_t len) const {
+  size_t first = std::min(len, ring.size() - pos);
+  std::memcpy(dst, ring.data() + pos, first);
+  std::memcpy(dst + first, ring.data(), len - first);
+}
+
+void History::evict_oldest() {
+  uint32_t len;
+  copy_out(head, reinterpret_cast<char*>(&len), sizeof(len));
+
+  size_t entry = sizeof(len) + len;
+  head = (head + entry) % ring.size();
+  used -= entry;
+  --count;
+}
+
+void History::add(std::string_view message) {
+  size_t entry = sizeof(uint32_t) + message.size();
+  if (entry > ring.size()) {
+    return;
+  }
+
+  while (ring.size() - used < entry) {
+    evict_oldest();
+  }
+
+  size_t tail = (head + used) % ring.size();
+  uint32_t len = message.size();
+  copy_in(tail, reinterpret_cast<const char*>(&len), sizeof(len));
+  copy_in((tail + sizeof(len)) % ring.size(), message.data(), message.size());
+
+  used += entry;
+  ++count;
+}
+
+} // namespace server
@@ -0,0 +1,204 @@
+#include "./include/ChatClient.hpp"
+#include "./include/Connection.hpp"
+#include "./include/EventLoop.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+// Headless load generator for ChatServer. Opens a pile of connections with
+// the regular client handshake, fires /pm and /broadcast at a fixed rate
+// and times how long each message takes to reach its recipients. Every
+// connection runs on one client::EventLoop, so it's a single thread.
+//
+//   loadgen <host> <port> <connections> <messages/sec> <seconds> [broadcast %]
+namespace {
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double percentile(std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p / 100.0 * sorted.size()));
+  return sorted[i] / 1e6;
+}
+
+void report_latency(const char* name, std::vector<uint64_t>& lat) {
+  std::sort(lat.begin(), lat.end());
+  std::cout << name << " latency ms (" << lat.size() << " deliveries):"
+    << " p50 " << percentile(lat, 50)
+    << " p90 " << percentile(lat, 90)
+    << " p99 " << percentile(lat, 99)
+    << " p99.9 " << percentile(lat, 99.9)
+    << " max " << (lat.empty() ? 0 : lat.back() / 1e6) << std::endl;
+}
+
+struct latencies {
+  std::vector<uint64_t> pm;
+  std::vector<uint64_t> broadcast;
+
+  // Everything we send is a 'p' or 'b' followed by the send time
+  void record(const std::string& plaintext) {
+    if (plaintext.size() < 2) {
+      return;
+    }
+    uint64_t sent = std::strtoull(plaintext.c_str() + 1, nullptr, 10);
+    uint64_t took = now_ns() - sent;
+    if (plaintext[0] == 'p') {
+      pm.push_back(took);
+    } else if (plaintext[0] == 'b') {
+      broadcast.push_back(took);
+    }
+  }
+};
+
+// Runs the loop until deadline, or forever with 0
+void run_until(client::EventLoop& loop, uint64_t deadline) {
+  while (true) {
+    uint64_t now = now_ns();
+    if (now >= deadline) {
+      return;
+    }
+    // poll only does milliseconds, round up so we never spin
+    loop.run_once(static_cast<int>((deadline - now + 999999) / 1000000));
+  }
+}
+
+void raise_fd_limit() {
+  rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 6) {
+    std::cout << "Usage: loadgen <host> <port> <connections> <messages/sec> <seconds> [broadcast %]" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  in_addr_t host = inet_addr(argv[1]);
+  int port = std::stoi(argv[2]);
+  size_t connections = std::stoul(argv[3]);
+  double rate = std::stod(argv[4]);
+  double seconds = std::stod(argv[5]);
+  int broadcast_pct = argc > 6 ? std::stoi(argv[6]) : 10;
+
+  raise_fd_limit();
+
+  EVP_PKEY* pubkey = client::ChatClient::load_public_key("rsa_pub.pem");
+  if (pubkey == nullptr) {
+    std::cerr << "Failed to read rsa_pub.pem" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // One thread drives every connection, handshakes included
+  client::EventLoop loop;
+  latencies lat;
+  size_t failed = 0;
+  size_t dropped = 0;
+  uint64_t setup_start = now_ns();
+
+  for (size_t i = 0; i < connections; ++i) {
+    std::string name = "lg" + std::to_string(i);
+    unsigned char key[32];
+    int sock = client::ChatClient::handshake(host, port, pubkey, name, key);
+    if (sock < 0) {
+      ++failed;
+      continue;
+    }
+
+    client::Connection& conn = loop.add(std::unique_ptr<client::Connection>(
+        new client::Connection(sock, key, name)));
+    conn.on_message = [&lat](client::Connection&, const std::string& m) { lat.record(m); };
+
+    // Keep up with the rekeys and history while the rest connect
+    loop.run_once(0);
+  }
+  loop.on_close = [&dropped](client::Connection&) { ++dropped; };
+
+  double setup = (now_ns() - setup_start) / 1e9;
+  EVP_PKEY_free(pubkey);
+
+  if (loop.size() == 0) {
+    std::cerr << "No connections made it through the handshake" << std::endl;
+    return EXIT_FAILURE;
+  }
+  size_t members = loop.size();
+
+  std::cout << std::fixed << std::setprecision(3);
+  std::cout << "connections: " << members << " up, " << failed << " failed in "
+    << setup << "s (" << members / setup << " conn/s)" << std::endl;
+
+  // Give the server a moment to finish registering everybody
+  run_until(loop, now_ns() + 500000000);
+  lat.pm.clear();
+  lat.broadcast.clear();
+
+  std::mt19937 rng(std::random_device{}());
+  std::uniform_int_distribution<int> percent(0, 99);
+
+  uint64_t interval = static_cast<uint64_t>(1e9 / rate);
+  uint64_t start = now_ns();
+  uint64_t end = start + static_cast<uint64_t>(seconds * 1e9);
+  uint64_t next = start;
+  size_t pms = 0;
+  size_t broadcasts = 0;
+
+  while (next < end && loop.size() > 0) {
+    run_until(loop, next);
+    next += interval;
+
+    std::uniform_int_distribution<size_t> pick(0, loop.size() - 1);
+    client::Connection& from = loop.at(pick(rng));
+    std::string message;
+    if (percent(rng) < broadcast_pct) {
+      message = "/broadcast b" + std::to_string(now_ns());
+      ++broadcasts;
+    } else {
+      message = "/pm " + loop.at(pick(rng)).name() + " p" + std::to_string(now_ns());
+      ++pms;
+    }
+    from.send(message);
+  }
+
+  double sending = (now_ns() - start) / 1e9;
+
+  // Let whatever is in flight land
+  run_until(loop, now_ns() + 1000000000);
+  double elapsed = (now_ns() - start) / 1e9;
+
+  size_t delivered = lat.pm.size() + lat.broadcast.size();
+  std::cout << "sent: " << pms << " pm, " << broadcasts << " broadcast in " << sending << "s ("
+    << (pms + broadcasts) / sending << " msg/s)" << std::endl;
+  std::cout << "delivered: " << delivered << " (" << delivered / elapsed << " msg/s), expected "
+    << pms + broadcasts * members;
+  if (dropped > 0) {
+    std::cout << ", " << dropped << " connections dropped";
+  }
+  std::cout << std::endl;
+  report_latency("pm       ", lat.pm);
+  report_latency("broadcast", lat.broadcast);
+
+  for (size_t i = 0; i < loop.size(); ++i) {
+    loop.at(i).send("/quit");
+  }
+  run_until(loop, now_ns() + 100000000);
+
+  return EXIT_SUCCESS;
+}
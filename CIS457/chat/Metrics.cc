@@ -0,0 +1,143 @@
+#include "./include/Metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+namespace metrics {
+
+namespace {
+  std::mutex registry_lock;
+  // Every shard ever handed out, they live as long as the process
+  std::vector<Shard*> shards;
+  std::vector<Shard*> free_shards;
+
+  struct holder {
+    Shard* shard = nullptr;
+
+    ~holder() {
+      if (shard != nullptr) {
+        std::lock_guard<std::mutex> lock(registry_lock);
+        free_shards.push_back(shard);
+      }
+    }
+  };
+
+  thread_local holder mine;
+
+  const char* counter_names[COUNTER_COUNT] = {
+    "messages_plain",
+    "cmd_list",
+    "cmd_broadcast",
+    "cmd_pm",
+    "cmd_kick",
+    "cmd_quit",
+    "messages_in",
+    "bytes_in",
+    "auth_failures",
+    "handshakes",
+    "handshake_failures",
+    "frames_queued",
+    "frames_dropped"
+  };
+
+  const char* timer_names[TIMER_COUNT] = {
+    "dispatch_plain",
+    "dispatch_list",
+    "dispatch_broadcast",
+    "dispatch_pm",
+    "dispatch_kick",
+    "dispatch_quit",
+    "handshake",
+    "rsa_decrypt",
+    "decrypt",
+    "encrypt",
+    "broadcast_fanout"
+  };
+
+  double percentile(const uint64_t* buckets, uint64_t total, double p) {
+    uint64_t want = static_cast<uint64_t>(p / 100.0 * total);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < hist::BUCKETS; ++b) {
+      seen += buckets[b];
+      if (seen > want) {
+        return hist::lower(b) / 1e3;
+      }
+    }
+    return hist::lower(hist::BUCKETS - 1) / 1e3;
+  }
+} // namespace
+
+Shard& local() {
+  if (mine.shard == nullptr) {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    if (!free_shards.empty()) {
+      // Keeps the old thread's numbers, they all get summed anyway
+      mine.shard = free_shards.back();
+      free_shards.pop_back();
+    } else {
+      mine.shard = new Shard();
+      shards.push_back(mine.shard);
+    }
+  }
+
+  return *mine.shard;
+}
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::string report() {
+  uint64_t counters[COUNTER_COUNT] = {};
+  std::vector<uint64_t> buckets(TIMER_COUNT * hist::BUCKETS);
+  uint64_t max[TIMER_COUNT] = {};
+
+  {
+    std::lock_guard<std::mutex> lock(registry_lock);
+    for (Shard* s : shards) {
+      for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+        counters[c] += s->counters[c].load(std::memory_order_relaxed);
+      }
+      for (size_t t = 0; t < TIMER_COUNT; ++t) {
+        for (size_t b = 0; b < hist::BUCKETS; ++b) {
+          buckets[t * hist::BUCKETS + b] += s->buckets[t][b].load(std::memory_order_relaxed);
+        }
+        max[t] = std::max(max[t], s->max[t].load(std::memory_order_relaxed));
+      }
+    }
+  }
+
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  for (size_t c = 0; c < COUNTER_COUNT; ++c) {
+    out << counter_names[c] << " " << counters[c] << "\n";
+  }
+
+  out << "timer count p50_us p90_us p99_us p99.9_us max_us\n";
+  for (size_t t = 0; t < TIMER_COUNT; ++t) {
+    const uint64_t* b = &buckets[t * hist::BUCKETS];
+    uint64_t total = 0;
+    for (size_t i = 0; i < hist::BUCKETS; ++i) {
+      total += b[i];
+    }
+    if (total == 0) {
+      continue;
+    }
+
+    out << timer_names[t] << " " << total
+      << " " << percentile(b, total, 50)
+      << " " << percentile(b, total, 90)
+      << " " << percentile(b, total, 99)
+      << " " << percentile(b, total, 99.9)
+      << " " << max[t] / 1e3 << "\n";
+  }
+
+  return out.str();
+}
+
+} // namespace metrics
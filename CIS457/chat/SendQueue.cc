@@ -0,0 +1,283 @@
+#include "./include/SendQueue.hpp"
+
+#include "./include/Metrics.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace server {
+
+// Frames handed to the kernel per sendmsg
+static const size_t MAX_BATCH = 64;
+
+SendQueue::SendQueue(size_t high_water, Policy policy, bool external)
+  : high_water(high_water), policy(policy), external(external) {
+  if (pipe(wake) < 0) {
+    std::cerr << "Failed to create the send queue wake pipe" << std::endl;
+    abort();
+  }
+  fcntl(wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(wake[1], F_SETFL, O_NONBLOCK);
+}
+
+SendQueue::~SendQueue() {
+  close(wake[0]);
+  close(wake[1]);
+}
+
+void SendQueue::add(int socket) {
+  std::lock_guard<std::mutex> guard(lock);
+  boxes[socket] = outbox();
+}
+
+void SendQueue::remove(int socket) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = boxes.find(socket);
+    if (it == boxes.end()) {
+      return;
+    }
+    it->second.closing = true;
+  }
+
+  // Only the flusher closes sockets, so it never writes to a reused fd
+  poke();
+}
+
+void SendQueue::poke() {
+  char c = 0;
+  write(wake[1], &c, 1);
+}
+
+void SendQueue::cut(int socket, outbox& box) {
+  // The kernel may still be reading lent out frames, complete() drops them
+  if (!box.in_flight) {
+    box.frames.clear();
+    box.offset = 0;
+    box.bytes = 0;
+  }
+  box.cut_off = true;
+
+  // The handler's recv sees EOF and cleans the user up
+  shutdown(socket, SHUT_RDWR);
+}
+
+bool SendQueue::push(int socket, frame_ptr frame, bool droppable) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = boxes.find(socket);
+  if (it == boxes.end() || it->second.closing || it->second.cut_off) {
+    return false;
+  }
+
+  outbox& box = it->second;
+  if (box.bytes + frame->size() > high_water) {
+    metrics::count(metrics::frames_dropped);
+    if (policy == drop && droppable) {
+      return false;
+    }
+
+    std::cout << "Disconnecting slow client on socket " << socket << std::endl;
+    cut(socket, box);
+    return false;
+  }
+
+  metrics::count(metrics::frames_queued);
+  bool was_idle = box.frames.empty();
+  box.bytes += frame->size();
+  box.frames.push_back(std::move(frame));
+
+  if (external) {
+    if (was_idle && !box.in_flight) {
+      dirty.push_back(socket);
+      poke();
+    }
+    return true;
+  }
+
+  if (was_idle) {
+    // Usually the socket has room and the frame goes out right here
+    if (!flush(socket, box)) {
+      cut(socket, box);
+      return false;
+    }
+
+    // Otherwise the flusher waits for it to become writable
+    if (!box.frames.empty()) {
+      poke();
+    }
+  }
+
+  return true;
+}
+
+bool SendQueue::flush(int socket, outbox& box) {
+  while (!box.frames.empty()) {
+    iovec iov[MAX_BATCH];
+    size_t count = 0;
+
+    for (auto it = box.frames.begin(); it != box.frames.end() && count < MAX_BATCH; ++it) {
+      size_t skip = count == 0 ? box.offset : 0;
+      iov[count].iov_base = const_cast<char*>((*it)->data()) + skip;
+      iov[count].iov_len = (*it)->size() - skip;
+      ++count;
+    }
+
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+
+    ssize_t sent = sendmsg(socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    advance(box, sent);
+
+    // Partial write, the socket buffer is full
+    if (!box.frames.empty() && box.offset > 0) {
+      return true;
+    }
+  }
+
+  return true;
+}
+
+void SendQueue::advance(outbox& box, size_t sent) {
+  box.bytes -= sent;
+  while (sent > 0) {
+    size_t rest = box.frames.front()->size() - box.offset;
+    if (sent < rest) {
+      box.offset += sent;
+      break;
+    }
+    sent -= rest;
+    box.offset = 0;
+    box.frames.pop_front();
+  }
+}
+
+void SendQueue::take_dirty(std::vector<int>& out) {
+  std::lock_guard<std::mutex> guard(lock);
+  out.swap(dirty);
+  dirty.clear();
+}
+
+size_t SendQueue::collect(int socket, iovec* iov, size_t max) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = boxes.find(socket);
+  if (it == boxes.end() || it->second.in_flight || it->second.closing || it->second.cut_off) {
+    return 0;
+  }
+
+  outbox& box = it->second;
+  size_t count = 0;
+  for (auto f = box.frames.begin(); f != box.frames.end() && count < max; ++f) {
+    size_t skip = count == 0 ? box.offset : 0;
+    iov[count].iov_base = const_cast<char*>((*f)->data()) + skip;
+    iov[count].iov_len = (*f)->size() - skip;
+    ++count;
+  }
+
+  box.in_flight = count > 0;
+  return count;
+}
+
+bool SendQueue::complete(int socket, size_t sent, bool failed) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto it = boxes.find(socket);
+  if (it == boxes.end()) {
+    return false;
+  }
+
+  outbox& box = it->second;
+  box.in_flight = false;
+  if (box.cut_off) {
+    box.frames.clear();
+    box.offset = 0;
+    box.bytes = 0;
+    return false;
+  }
+
+  advance(box, sent);
+  if (failed) {
+    cut(socket, box);
+    return false;
+  }
+
+  return !box.frames.empty() && !box.closing;
+}
+
+void SendQueue::take_closed(std::vector<int>& out) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto it = boxes.begin(); it != boxes.end();) {
+    if (it->second.closing && !it->second.in_flight) {
+      out.push_back(it->first);
+      it = boxes.erase(it);
+      continue;
+    }
+    ++it;
+  }
+}
+
+void* SendQueue::flusher(void* args) {
+  SendQueue* q = static_cast<SendQueue*>(args);
+  std::vector<pollfd> fds;
+
+  while (true) {
+    fds.clear();
+    fds.push_back({q->wake[0], POLLIN, 0});
+
+    {
+      std::lock_guard<std::mutex> guard(q->lock);
+      for (auto it = q->boxes.begin(); it != q->boxes.end();) {
+        if (it->second.closing) {
+          close(it->first);
+          it = q->boxes.erase(it);
+          continue;
+        }
+
+        if (!it->second.frames.empty()) {
+          fds.push_back({it->first, POLLOUT, 0});
+        }
+        ++it;
+      }
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char drain[256];
+      while (read(q->wake[0], drain, sizeof(drain)) > 0) {}
+    }
+
+    std::lock_guard<std::mutex> guard(q->lock);
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+
+      auto it = q->boxes.find(fds[i].fd);
+      if (it == q->boxes.end() || it->second.closing) {
+        continue;
+      }
+
+      if (!q->flush(it->first, it->second)) {
+        q->cut(it->first, it->second);
+      }
+    }
+  }
+
+  return nullptr;
+}
+
+} // namespace server
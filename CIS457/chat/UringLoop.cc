@@ -0,0 +1,432 @@
+#include "./include/UringLoop.hpp"
+
+#include "./include/Frame.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace server {
+
+// What a completion belongs to lives in the top byte of user_data, then a
+// 24 bit generation so completions for a reused fd can be told apart
+enum op : uint64_t {
+  ACCEPT = 1,
+  RECV,
+  SEND,
+  WAKE,
+  TICK
+};
+
+static const unsigned RING_ENTRIES = 1024;
+static const uint16_t BUFFER_GROUP = 0;
+static const unsigned BUFFER_COUNT = 1024;
+static const unsigned BUFFER_SIZE = 4096;
+// Key plus the biggest username frame we'll take
+static const size_t MAX_HELLO = 256 + frame::HEADER_SIZE + ChatServer::MAX_USERNAME;
+
+static uint64_t pack(op o, uint32_t generation, int fd) {
+  return (static_cast<uint64_t>(o) << 56)
+    | (static_cast<uint64_t>(generation & 0xffffff) << 32)
+    | static_cast<uint32_t>(fd);
+}
+
+UringLoop::UringLoop(ChatServer* server, int listen_socket)
+  : server(server), listen_socket(listen_socket) {
+  tick.tv_sec = 1;
+  tick.tv_nsec = 0;
+}
+
+bool UringLoop::init() {
+  if (!ring.init(RING_ENTRIES)) {
+    return false;
+  }
+  // Buffer recycles post nothing when they work, which needs 5.17, or every
+  // one of them would come back as a completion
+  if (!ring.has_feature(IORING_FEAT_CQE_SKIP)) {
+    return false;
+  }
+  if (!ring.setup_buffers(BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE)) {
+    return false;
+  }
+  // Accepts and receives are multishot, 5.19 and 6.0. An older kernel turns
+  // them down and the loop would only spin re-arming them.
+  if (!ring.multishot_works()) {
+    return false;
+  }
+
+  if (!ring.using_buffer_ring()) {
+    std::cout << "Provided buffer rings don't work here, using PROVIDE_BUFFERS" << std::endl;
+  }
+  return true;
+}
+
+void UringLoop::arm_accept() {
+  uring::prep_multishot_accept(ring.get_sqe(), listen_socket, pack(ACCEPT, 0, listen_socket));
+}
+
+void UringLoop::arm_recv(int socket, const connection& c) {
+  uring::prep_multishot_recv(ring.get_sqe(), socket, BUFFER_GROUP, pack(RECV, c.generation, socket));
+}
+
+void UringLoop::arm_wake() {
+  int fd = server->outbound->wake_fd();
+  uring::prep_poll(ring.get_sqe(), fd, POLLIN, pack(WAKE, 0, fd));
+}
+
+void UringLoop::arm_tick() {
+  uring::prep_timeout(ring.get_sqe(), &tick, pack(TICK, 0, -1));
+}
+
+void UringLoop::joined(ChatServer::thread* t) {
+  {
+    std::lock_guard<std::mutex> lock(handoff_lock);
+    handoff_joined.push_back(t);
+  }
+  server->outbound->poke();
+}
+
+void UringLoop::rejected(int socket) {
+  {
+    std::lock_guard<std::mutex> lock(handoff_lock);
+    handoff_rejected.push_back(socket);
+  }
+  server->outbound->poke();
+}
+
+void UringLoop::run() {
+  arm_accept();
+  arm_wake();
+  arm_tick();
+
+  while (true) {
+    if (ring.submit_and_wait(1) < 0 && errno != EBUSY) {
+      std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
+      return;
+    }
+
+    ring.for_each_cqe([this](const io_uring_cqe& cqe) {
+      op o = static_cast<op>(cqe.user_data >> 56);
+      uint32_t generation = (cqe.user_data >> 32) & 0xffffff;
+      int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+      bool more = cqe.flags & IORING_CQE_F_MORE;
+
+      if (cqe.user_data == 0) {
+        std::cerr << "Failed to give a receive buffer back: " << strerror(-cqe.res) << std::endl;
+        return;
+      }
+      if (o == ACCEPT) {
+        on_accept(cqe.res, more);
+        return;
+      }
+      if (o == WAKE) {
+        char drain[256];
+        while (read(fd, drain, sizeof(drain)) > 0) {}
+        arm_wake();
+        return;
+      }
+      if (o == TICK) {
+        expire_hellos();
+        if (accept_backoff) {
+          accept_backoff = false;
+          arm_accept();
+        }
+        arm_tick();
+        return;
+      }
+
+      auto it = conns.find(fd);
+      if (it == conns.end() || it->second.generation != generation) {
+        // Leftover from a connection that's already closed
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+          ring.recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return;
+      }
+
+      if (o == RECV) {
+        on_recv(fd, it->second, cqe.res, cqe.flags);
+      } else if (o == SEND) {
+        on_send(fd, it->second, cqe.res);
+      }
+    });
+
+    service();
+  }
+}
+
+void UringLoop::on_accept(int res, bool more) {
+  if (res >= 0) {
+    connection& c = conns[res];
+    c.generation = next_generation++;
+    c.accepted = time(nullptr);
+
+    socklen_t len = sizeof(c.user.client);
+    getpeername(res, reinterpret_cast<sockaddr*>(&c.user.client), &len);
+
+    std::cout << "Client conected" << std::endl;
+    arm_recv(res, c);
+  } else {
+    std::cout << "Error, failed to connect client: " << strerror(-res) << std::endl;
+  }
+
+  if (!more) {
+    // Re-arming straight into the same error, out of descriptors most
+    // likely, would only spin. The next tick tries again.
+    if (res < 0) {
+      accept_backoff = true;
+    } else {
+      arm_accept();
+    }
+  }
+}
+
+void UringLoop::on_recv(int socket, connection& c, int res, uint32_t flags) {
+  bool more = flags & IORING_CQE_F_MORE;
+
+  if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+    uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    c.inbuf.append(ring.buffer(bid), res);
+    ring.recycle(bid);
+
+    if (!c.dead) {
+      consume(socket, c);
+    }
+    // consume() may have closed it
+    auto it = conns.find(socket);
+    if (it == conns.end() || &it->second != &c) {
+      return;
+    }
+  }
+
+  if (more || c.dead) {
+    return;
+  }
+
+  // Out of buffers or the kernel just ended the multishot, keep reading
+  if (res > 0 || res == -ENOBUFS) {
+    arm_recv(socket, c);
+    return;
+  }
+
+  disconnect(socket, c);
+}
+
+void UringLoop::consume(int socket, connection& c) {
+  if (c.stage == hello) {
+    if (c.inbuf.size() < 256 + frame::HEADER_SIZE) {
+      return;
+    }
+
+    uint32_t len;
+    std::memcpy(&len, c.inbuf.data() + 256, sizeof(len));
+    size_t total = 256 + frame::HEADER_SIZE + ntohl(len);
+    if (total > MAX_HELLO) {
+      std::cerr << "Failed to get username, killing session" << std::endl;
+      close_connection(socket);
+      return;
+    }
+    if (c.inbuf.size() < total) {
+      return;
+    }
+
+    c.greeting = c.inbuf.substr(0, total);
+    c.inbuf.erase(0, total);
+    c.stage = waiting;
+
+    // Workers are busy, it goes in once one frees up
+    if (!offer(socket, c)) {
+      waiting_list.push_back({socket, c.generation});
+    }
+    return;
+  }
+
+  if (c.stage == waiting || c.stage == handshaking) {
+    // Anything sent before the workers are done waits for joined(), but
+    // only up to one frame's worth
+    if (c.inbuf.size() > frame::HEADER_SIZE + frame::MAX_PAYLOAD) {
+      disconnect(socket, c);
+    }
+    return;
+  }
+
+  size_t offset = 0;
+  frame::Type type;
+  std::string data;
+  std::string message;
+  bool bad = false;
+
+  while (frame::next(c.inbuf, offset, type, data, bad)) {
+    if (!server->receive(c.user, data, message)) {
+      disconnect(socket, c);
+      return;
+    }
+  }
+
+  if (bad) {
+    disconnect(socket, c);
+    return;
+  }
+
+  c.inbuf.erase(0, offset);
+}
+
+void UringLoop::disconnect(int socket, connection& c) {
+  if (c.dead) {
+    return;
+  }
+  c.dead = true;
+
+  if (c.stage == hello || c.stage == waiting) {
+    close_connection(socket);
+  } else if (c.stage == chatting) {
+    // The send queue tells us when it's done with the socket
+    server->remove_user(socket);
+  }
+  // Handshaking waits on joined() or rejected()
+}
+
+bool UringLoop::offer(int socket, connection& c) {
+  ChatServer::pending_handshake pending;
+  pending.socket = socket;
+  pending.client = c.user.client;
+  pending.hello = c.greeting;
+
+  if (!server->offer_handshake(std::move(pending))) {
+    return false;
+  }
+
+  c.greeting.clear();
+  c.stage = handshaking;
+  return true;
+}
+
+void UringLoop::close_connection(int socket) {
+  // Kicks the multishot recv out too, close alone wouldn't
+  shutdown(socket, SHUT_RDWR);
+  close(socket);
+  conns.erase(socket);
+}
+
+void UringLoop::start_send(int socket, connection& c) {
+  size_t count = server->outbound->collect(socket, c.iov, MAX_IOV);
+  if (count == 0) {
+    return;
+  }
+
+  size_t per_link = (count + MAX_LINKS - 1) / MAX_LINKS;
+  c.links = 0;
+  c.finished = 0;
+  c.sent = 0;
+  c.failed = false;
+
+  for (size_t first = 0; first < count; first += per_link) {
+    msghdr& msg = c.msgs[c.links++];
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = c.iov + first;
+    msg.msg_iovlen = std::min(per_link, count - first);
+  }
+
+  // A short send breaks the chain, so later parts never jump ahead of it
+  for (size_t i = 0; i < c.links; ++i) {
+    io_uring_sqe* sqe = ring.get_sqe();
+    uring::prep_sendmsg(sqe, socket, &c.msgs[i], MSG_NOSIGNAL | MSG_WAITALL, pack(SEND, c.generation, socket));
+    if (i + 1 < c.links) {
+      sqe->flags |= IOSQE_IO_LINK;
+    }
+  }
+}
+
+void UringLoop::on_send(int socket, connection& c, int res) {
+  if (res > 0) {
+    c.sent += res;
+  } else if (res < 0 && res != -ECANCELED) {
+    c.failed = true;
+  }
+
+  if (++c.finished < c.links) {
+    return;
+  }
+  c.links = 0;
+
+  if (server->outbound->complete(socket, c.sent, c.failed)) {
+    start_send(socket, c);
+  }
+}
+
+void UringLoop::service() {
+  std::vector<ChatServer::thread*> joined;
+  std::vector<int> rejected;
+  {
+    std::lock_guard<std::mutex> lock(handoff_lock);
+    joined.swap(handoff_joined);
+    rejected.swap(handoff_rejected);
+  }
+
+  for (ChatServer::thread* t : joined) {
+    auto it = conns.find(t->socket);
+    if (it != conns.end()) {
+      connection& c = it->second;
+      c.user = *t;
+      c.stage = chatting;
+
+      if (c.dead) {
+        // Left while the workers were busy with them
+        c.dead = false;
+        disconnect(t->socket, c);
+      } else {
+        consume(t->socket, c);
+      }
+    }
+    delete t;
+  }
+
+  for (int socket : rejected) {
+    close_connection(socket);
+  }
+
+  while (!waiting_list.empty()) {
+    auto it = conns.find(waiting_list.front().first);
+    if (it != conns.end() && it->second.generation == waiting_list.front().second
+        && it->second.stage == waiting && !offer(it->first, it->second)) {
+      break;
+    }
+    waiting_list.pop_front();
+  }
+
+  scratch.clear();
+  server->outbound->take_dirty(scratch);
+  for (int socket : scratch) {
+    auto it = conns.find(socket);
+    if (it != conns.end() && it->second.links == 0) {
+      start_send(socket, it->second);
+    }
+  }
+
+  scratch.clear();
+  server->outbound->take_closed(scratch);
+  for (int socket : scratch) {
+    close_connection(socket);
+  }
+}
+
+void UringLoop::expire_hellos() {
+  time_t now = time(nullptr);
+
+  scratch.clear();
+  for (const auto& entry : conns) {
+    if (entry.second.stage == hello && now - entry.second.accepted >= ChatServer::HANDSHAKE_TIMEOUT) {
+      scratch.push_back(entry.first);
+    }
+  }
+
+  for (int socket : scratch) {
+    std::cerr << "Handshake timed out, killing session" << std::endl;
+    close_connection(socket);
+  }
+}
+
+} // namespace server
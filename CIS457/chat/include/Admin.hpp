@@ -0,0 +1,32 @@
+#ifndef CHAT_ADMIN_HPP
+#define CHAT_ADMIN_HPP
+
+#include <string>
+
+namespace server {
+class ChatServer;
+
+// Local admin interface on a Unix socket that only the server's user can
+// open. One command per connection, the reply comes back and the socket
+// closes:
+//   stats        counters and latency percentiles for this process
+//   list         users on this process
+//   kick <name>  kicks them wherever they are connected
+class Admin {
+  public:
+    Admin(ChatServer* server, std::string path);
+
+    // Binds the socket and starts the thread serving it
+    bool start();
+
+  private:
+    ChatServer* server;
+    std::string path;
+    int sock = -1;
+
+    static void* serve(void* args);
+    std::string run(const std::string& line);
+};
+} // namespace server
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef CHAT_BUS_HPP
+#define CHAT_BUS_HPP
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace server {
+class ChatServer;
+
+// Glue between worker processes sharing one port through SO_REUSEPORT.
+// Every worker owns the receiving end of an AF_UNIX datagram socket and
+// holds a sending end to everyone else's. Workers announce who joins and
+// leaves, and forward /pm, /broadcast and /kick to the workers that need
+// them. Each worker keeps its own users and lock, and the bus only carries
+// plaintext between processes on this box.
+class Bus {
+  public:
+    // Biggest message we forward, bigger ones stay local
+    static const size_t MAX_MESSAGE = 64 * 1024;
+
+    // Makes the sockets for count workers, call before forking
+    explicit Bus(size_t count);
+
+    // Called in the child right after fork, drops the ends it doesn't use
+    void attach(size_t index);
+
+    // Starts the thread that applies what other workers send
+    void start(ChatServer* server);
+
+    void joined(std::string_view name);
+    void left(std::string_view name);
+    // Hands a broadcast to every other worker
+    void broadcast(std::string_view body);
+    // Forwards to the workers that have someone called who
+    void pm(std::string_view who, std::string_view body);
+    void kick(std::string_view who);
+
+    // Names connected to the other workers
+    void remote_names(std::vector<std::string>& out);
+
+    size_t worker() const { return self; }
+
+  private:
+    enum kind : char {
+      JOIN = 'J',
+      LEAVE = 'L',
+      BROADCAST = 'B',
+      PM = 'P',
+      KICK = 'K'
+    };
+
+    size_t self = 0;
+    ChatServer* server = nullptr;
+
+    // inbox[i] is read by worker i, outbox[i] is how the others reach it
+    std::vector<int> inbox;
+    std::vector<int> outbox;
+
+    // Who is on which other worker, a name can be on several
+    std::mutex presence_lock;
+    std::unordered_multimap<std::string, size_t> presence;
+
+    // [kind][sender][name length][name][body]
+    static std::string pack(kind k, size_t from, std::string_view name, std::string_view body);
+    void send_to(size_t index, const std::string& message);
+    void send_all(const std::string& message);
+    void owners(std::string_view name, std::vector<size_t>& out);
+
+    static void* receiver(void* args);
+    void apply(const char* data, size_t len);
+};
+} // namespace server
+
+#endif
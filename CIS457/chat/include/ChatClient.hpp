@@ -1,6 +1,8 @@
 #ifndef CHAT_CHATCLIENT_HPP
 #define CHAT_CHATCLIENT_HPP
 
+#include "Crypto.hpp"
+
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <string>
@@ -13,13 +15,18 @@ class ChatClient {
     const std::string version = "0.1.0";
 
     int RunClient();
-    // Holds thread specific shit
-    struct thread {
-      // Whatever socket it's bound to
-      int socket;
-      // To decrypt our goodies
-      unsigned char key[32];
-    };
+
+    // Reads a PEM public key, nullptr if it can't
+    static EVP_PKEY* load_public_key(const char* path);
+
+    // Connects, generates a session key and sends it RSA wrapped along with
+    // the username. Returns the connected socket, or -1.
+    static int handshake(
+        in_addr_t host,
+        int port,
+        EVP_PKEY* pubkey,
+        const std::string& username,
+        unsigned char key[32]);
 
     struct std_message {
       std::string cipher;
@@ -32,17 +39,16 @@ class ChatClient {
       unsigned char* encrypted_key;
     };
 
-    void setKicked(bool kicked);
-    bool getKicked();
   private:
     const int MAXDATASIZE = 4096;
-    static void* client_handler(void* args);
     bool kicked = false;
 
     int handle_port();
     in_addr_t handle_host();
 
-    std::string handle_input();
+    // Reads stdin a byte at a time so nothing typed after the prompts gets
+    // stuck in a buffer the event loop can't see
+    static std::string read_line();
 };
 } // namespace client
 
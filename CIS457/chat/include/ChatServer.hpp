@@ -1,19 +1,37 @@
 #ifndef CHAT_CHAT_SERVER_HPP
 #define CHAT_CHAT_SERVER_HPP
 
-#include "../include/User.hpp"
+#include "Crypto.hpp"
+#include "Frame.hpp"
+#include "History.hpp"
+#include "SendQueue.hpp"
 
 #include <arpa/inet.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
 
 namespace server {
+class Bus;
+class UringLoop;
+
 class ChatServer {
   public:
     const std::string version = "0.1.0";
     const int MAXDATASIZE = 4096;
+    // Accepted sockets waiting for a handshake worker
+    static const size_t MAX_PENDING_HANDSHAKES = 128;
+    // Seconds a client gets to send its key and username
+    static const int HANDSHAKE_TIMEOUT = 5;
+    static const size_t MAX_USERNAME = 100;
+    // Bytes of recent broadcasts replayed to people who join
+    static const size_t HISTORY_BYTES = 64 * 1024;
     int taken = 0;
 
     int RunServer();
@@ -29,6 +47,9 @@ class ChatServer {
       // To decrypt our goodies
       unsigned char key[32];
 
+      // Keyed cipher contexts, shared by every copy of this user
+      std::shared_ptr<yep::Session> session;
+
       ChatServer* instance;
     };
 
@@ -39,11 +60,6 @@ class ChatServer {
       unsigned char iv[16];
     };
 
-    bool get_admin();
-    void set_admin(bool admin);
-
-  std::pair<std::string, int> encrypt_string(std::string input, unsigned char key[32]);
-  
     // The /list command
     void list_users();
 
@@ -52,20 +68,82 @@ class ChatServer {
 
     // Currently connected users
     std::vector<thread> users;
+    std::mutex users_lock;
+
+    // Encrypt /broadcast once with a shared key instead of once per user
+    bool use_room_key = false;
+    unsigned char room_key[32];
+    std::unique_ptr<yep::Session> room;
+
+    // Recent broadcasts, guarded by users_lock
+    History history = History(HISTORY_BYTES);
+
+    // Hands every member a fresh room key, call with users_lock held
+    void rotate_room_key();
+
+    // Drops a user from the room, rotating the room key if we use one
+    void remove_user(int socket);
+
+    // Every write to a client goes through here, never a blocking send
+    std::unique_ptr<SendQueue> outbound;
+
+    // Seals a message with the user's session and queues it for them
+    void send_to(thread& user, frame::Type type, std::string_view message);
+
+    // Decrypts and runs one frame payload from a user, false once they
+    // quit or the frame doesn't authenticate
+    bool receive(thread& t, const std::string& payload, std::string& message);
+
+    // Runs one decrypted message from a user, false once they quit
+    bool handle_message(thread& t, const std::string& message);
+
+    // Delivery to the users on this process, the bus calls these too
+    void deliver_broadcast(std::string_view body);
+    void deliver_pm(std::string_view who, std::string_view body);
+    void kick_user(std::string_view who);
+
+    struct pending_handshake {
+      int socket;
+      struct sockaddr_in client;
+      // Key and username already read off the socket by the io_uring loop
+      std::string hello;
+    };
+
+    std::deque<pending_handshake> handshakes;
+    std::mutex handshake_lock;
+    std::condition_variable handshake_ready;
+    std::condition_variable handshake_space;
+
+    // Queues a handshake without waiting, false if the workers are swamped
+    bool offer_handshake(pending_handshake pending);
 
   private:
-    bool is_admin;
-    bool check_admin(const std::string& pass);
+    friend class Admin;
+
     static void* server_handler(void* args);
 
-    int handle_port();
+    // Loaded once at startup and shared by every handshake
+    EVP_PKEY* privkey = nullptr;
 
-    std::string handle_input(std::string prompt);
+    // Set when the io_uring backend drives the sockets
+    UringLoop* uring = nullptr;
+
+    // Set when several worker processes share the port
+    Bus* bus = nullptr;
+
+    static void* handshake_worker(void* args);
+    // RSA key exchange and username, then hands the socket to server_handler
+    // or the io_uring loop
+    void handshake(const pending_handshake& pending);
+    void reject_handshake(int socket);
 
-    // Making auto for bool return or string
-    std::string extract_command(const std::string& input) const;
+    int handle_port();
+
+    // Forks count copies of the server. Returns the worker index in each
+    // child, or -1 in the parent once they have all exited.
+    static int fork_workers(size_t count);
 
-    std::string admin_password = "1234";
+    std::string handle_input(std::string prompt);
 
 };
 } // namespace server
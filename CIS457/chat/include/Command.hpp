@@ -0,0 +1,125 @@
+#ifndef CHAT_COMMAND_HPP
+#define CHAT_COMMAND_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace command {
+  enum Id : uint8_t {
+    none,
+    list,
+    broadcast,
+    pm,
+    kick,
+    quit
+  };
+
+  // Whitespace tokenizer over a view of the message, nothing gets copied
+  class Tokens {
+    public:
+      explicit constexpr Tokens(std::string_view input) : rest(input) {}
+
+      // Next word, empty once we run out
+      constexpr std::string_view next() {
+        skip_space();
+        size_t end = 0;
+        while (end < rest.size() && !is_space(rest[end])) {
+          ++end;
+        }
+
+        std::string_view word = rest.substr(0, end);
+        rest.remove_prefix(end);
+        return word;
+      }
+
+      // Whatever is left after the words taken so far, e.g. a message body
+      constexpr std::string_view remainder() {
+        skip_space();
+        return rest;
+      }
+
+    private:
+      std::string_view rest;
+
+      static constexpr bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+      }
+
+      constexpr void skip_space() {
+        while (!rest.empty() && is_space(rest.front())) {
+          rest.remove_prefix(1);
+        }
+      }
+  };
+
+  namespace detail {
+    struct entry {
+      std::string_view name;
+      Id id;
+    };
+
+    constexpr entry commands[] = {
+      {"list", list},
+      {"broadcast", broadcast},
+      {"pm", pm},
+      {"kick", kick},
+      {"quit", quit}
+    };
+
+    // First letter plus length happens to land every command in its own slot
+    constexpr size_t TABLE_SIZE = 8;
+
+    constexpr size_t hash(std::string_view name) {
+      return (static_cast<unsigned char>(name[0]) + name.size()) % TABLE_SIZE;
+    }
+
+    struct table {
+      entry slots[TABLE_SIZE] = {};
+
+      constexpr table() {
+        for (const auto& e : commands) {
+          slots[hash(e.name)] = e;
+        }
+      }
+    };
+
+    constexpr table TABLE{};
+
+    constexpr bool perfect() {
+      for (const auto& e : commands) {
+        if (TABLE.slots[hash(e.name)].id != e.id) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    static_assert(perfect(), "two commands hash to the same slot, adjust hash()");
+  } // namespace detail
+
+  // Maps a command name (no slash) to its id, one probe and one compare
+  constexpr Id lookup(std::string_view name) {
+    if (name.empty()) {
+      return none;
+    }
+
+    const detail::entry& e = detail::TABLE.slots[detail::hash(name)];
+    return e.name == name ? e.id : none;
+  }
+
+  // Pulls the leading "/command" off the tokens, none if it isn't one
+  constexpr Id parse(Tokens& tokens) {
+    std::string_view first = tokens.next();
+    if (first.size() < 2 || first[0] != '/') {
+      return none;
+    }
+
+    return lookup(first.substr(1));
+  }
+
+  static_assert(lookup("broadcast") == broadcast, "command table is broken");
+  static_assert(lookup("pmx") == none, "command table is broken");
+} // namespace command
+
+#endif
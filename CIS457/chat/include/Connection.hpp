@@ -0,0 +1,62 @@
+#ifndef CHAT_CONNECTION_HPP
+#define CHAT_CONNECTION_HPP
+
+#include "Crypto.hpp"
+#include "Frame.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace client {
+// One logged in chat session on a non-blocking socket. Reads are framed
+// out of an input buffer and writes go through an output buffer, so an
+// EventLoop can drive as many of these as it likes from one thread.
+class Connection {
+  public:
+    // Takes over a socket that already went through ChatClient::handshake
+    Connection(int socket, const unsigned char key[32], std::string name);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    // A decrypted direct or room message
+    std::function<void(Connection&, const std::string&)> on_message;
+    // A plaintext control frame, e.g. "kicked"
+    std::function<void(Connection&, const std::string&)> on_control;
+
+    // Seals a message and writes what the socket takes, false once the
+    // connection is dead
+    bool send(std::string_view message);
+
+    // Called by the loop, false once the connection is done
+    bool on_readable();
+    bool on_writable() { return flush(); }
+
+    bool want_write() const { return out_offset < outbuf.size(); }
+    int fd() const { return socket; }
+    const std::string& name() const { return username; }
+
+  private:
+    int socket;
+    std::string username;
+    yep::Session session;
+    std::unique_ptr<yep::Session> room;
+
+    std::string inbuf;
+    std::string outbuf;
+    // How much of outbuf already went out
+    size_t out_offset = 0;
+
+    // Scratch kept around so dispatch doesn't allocate per frame
+    std::string payload;
+    std::string plaintext;
+
+    bool flush();
+    void dispatch(frame::Type type);
+};
+} // namespace client
+
+#endif
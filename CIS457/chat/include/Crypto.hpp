@@ -1,5 +1,8 @@
 #pragma once
 
+#include "Frame.hpp"
+
+#include <cstdint>
 #include <cstring>
 #include <openssl/conf.h>
 #include <openssl/err.h>
@@ -19,4 +22,42 @@ class Crypto {
     int decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *key,
           unsigned char *iv, unsigned char *plaintext);
 };
+
+// AES-256-GCM state for one connection. The cipher contexts are keyed once
+// and only the nonce changes per message. Nonces are a 4 byte direction
+// prefix plus a 64 bit counter that travels in front of the ciphertext, so
+// dropped frames are fine but replayed or reordered ones are refused.
+class Session {
+  public:
+    enum Role {
+      client,
+      server
+    };
+
+    // Counter in front, GCM tag at the back
+    static const size_t OVERHEAD = 8 + 16;
+
+    Session(const unsigned char key[32], Role role);
+    ~Session();
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Encrypts plaintext straight into a new frame appended to out
+    void seal(frame::Type type, const unsigned char* plaintext, size_t len, std::string& out);
+
+    // Decrypts a frame payload into plaintext, false if it fails to authenticate
+    bool open(const std::string& payload, std::string& plaintext);
+
+  private:
+    EVP_CIPHER_CTX* enc;
+    EVP_CIPHER_CTX* dec;
+    unsigned char send_prefix[4];
+    unsigned char recv_prefix[4];
+    uint64_t send_counter = 0;
+    // Lowest counter we will still accept
+    uint64_t recv_counter = 0;
+
+    void handleErrors();
+};
 } // namespace crypto
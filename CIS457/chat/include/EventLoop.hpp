@@ -0,0 +1,50 @@
+#ifndef CHAT_EVENT_LOOP_HPP
+#define CHAT_EVENT_LOOP_HPP
+
+#include "Connection.hpp"
+
+#include <functional>
+#include <memory>
+#include <poll.h>
+#include <string>
+#include <vector>
+
+namespace client {
+// Single threaded poll loop over any number of Connections, plus stdin
+// for the interactive client.
+class EventLoop {
+  public:
+    // The loop owns the connection from now on
+    Connection& add(std::unique_ptr<Connection> conn);
+
+    // Hands every line typed on stdin to on_line, on_eof once it closes
+    void watch_stdin(std::function<void(const std::string&)> on_line, std::function<void()> on_eof);
+
+    // Called right before a dead connection is freed
+    std::function<void(Connection&)> on_close;
+
+    // Waits up to timeout_ms (-1 forever) and handles whatever is ready.
+    // False once stop() was called or there is nothing left to watch.
+    bool run_once(int timeout_ms);
+    void run();
+    void stop() { running = false; }
+
+    size_t size() const { return conns.size(); }
+    Connection& at(size_t i) { return *conns[i]; }
+
+  private:
+    std::vector<std::unique_ptr<Connection>> conns;
+    std::vector<pollfd> fds;
+    bool running = true;
+
+    bool stdin_open = false;
+    std::string stdin_buf;
+    std::function<void(const std::string&)> on_line;
+    std::function<void()> on_eof;
+
+    void read_stdin();
+    void drop(size_t i);
+};
+} // namespace client
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef CHAT_FRAME_HPP
+#define CHAT_FRAME_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace frame {
+  // Everything the server sends after the handshake goes out as
+  // [4 byte big endian payload length][1 byte type][payload]
+  enum Type : uint8_t {
+    // Encrypted with the receiver's own session key
+    direct = 'D',
+    // Encrypted with the shared room key
+    group = 'G',
+    // A fresh room key, encrypted with the receiver's own session key
+    rekey = 'R',
+    // Plaintext control message, e.g. "kicked"
+    control = 'C'
+  };
+
+  const size_t HEADER_SIZE = 5;
+  const uint32_t MAX_PAYLOAD = 1 << 20;
+
+  // Writes the 5 byte frame header into dst
+  void write_header(unsigned char* dst, Type type, uint32_t len);
+
+  // Builds a ready to send frame
+  std::string make(Type type, const unsigned char* payload, size_t len);
+
+  // Blocks until a whole frame has been read, false on disconnect
+  bool read(int socket, Type& type, std::string& payload);
+
+  // Pulls the next whole frame out of buffer starting at offset, for
+  // callers doing their own non-blocking reads. False if it isn't all there
+  // yet or the length is bogus, which the caller tells apart with bad.
+  bool next(const std::string& buffer, size_t& offset, Type& type, std::string& payload, bool& bad);
+
+  // Blocks until exactly len bytes have been read
+  bool recv_all(int socket, char* buf, size_t len);
+
+  // Keeps sending until the whole buffer is written
+  bool send_all(int socket, const char* data, size_t len);
+} // namespace frame
+
+#endif
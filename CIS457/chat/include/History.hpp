@@ -0,0 +1,61 @@
+#ifndef CHAT_HISTORY_HPP
+#define CHAT_HISTORY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace server {
+// Recent room messages kept in one fixed block of memory. Each entry is a
+// 4 byte length followed by the message, ready to be sealed for whoever
+// joins next. Adding a message evicts the oldest ones until it fits, so the
+// history never takes more than its capacity in bytes.
+class History {
+  public:
+    explicit History(size_t capacity);
+
+    // Messages bigger than the whole ring are not kept
+    void add(std::string_view message);
+
+    // Calls fn with every message, oldest first
+    template <typename Fn>
+    void for_each(Fn fn) const {
+      std::string scratch;
+      size_t pos = head;
+
+      for (size_t i = 0; i < count; ++i) {
+        uint32_t len;
+        copy_out(pos, reinterpret_cast<char*>(&len), sizeof(len));
+        pos = (pos + sizeof(len)) % ring.size();
+
+        if (pos + len <= ring.size()) {
+          fn(std::string_view(ring.data() + pos, len));
+        } else {
+          // Entry wraps around the end of the ring
+          scratch.resize(len);
+          copy_out(pos, &scratch[0], len);
+          fn(std::string_view(scratch));
+        }
+        pos = (pos + len) % ring.size();
+      }
+    }
+
+    size_t size() const { return count; }
+    size_t bytes() const { return used; }
+
+  private:
+    std::vector<char> ring;
+    // Offset of the oldest entry
+    size_t head = 0;
+    size_t used = 0;
+    size_t count = 0;
+
+    void copy_in(size_t pos, const char* src, size_t len);
+    void copy_out(size_t pos, char* dst, size_t len) const;
+    void evict_oldest();
+};
+} // namespace server
+
+#endif
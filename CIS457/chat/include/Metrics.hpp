@@ -0,0 +1,127 @@
+#ifndef CHAT_METRICS_HPP
+#define CHAT_METRICS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace metrics {
+  // The cmd_* entries line up with command::Id
+  enum Counter {
+    cmd_none,
+    cmd_list,
+    cmd_broadcast,
+    cmd_pm,
+    cmd_kick,
+    cmd_quit,
+    messages_in,
+    bytes_in,
+    auth_failures,
+    handshakes,
+    handshake_failures,
+    frames_queued,
+    frames_dropped,
+    COUNTER_COUNT
+  };
+
+  // Nanosecond timings, the dispatch_* entries line up with command::Id
+  enum Timer {
+    dispatch_none,
+    dispatch_list,
+    dispatch_broadcast,
+    dispatch_pm,
+    dispatch_kick,
+    dispatch_quit,
+    handshake,
+    rsa_decrypt,
+    decrypt,
+    encrypt,
+    broadcast_fanout,
+    TIMER_COUNT
+  };
+
+  // Log-linear buckets in the style of HdrHistogram: 8 buckets per power
+  // of two, so any value is off by at most 12.5%. Anything past 2^40 ns
+  // (about 18 minutes) lands in the last bucket.
+  namespace hist {
+    const unsigned SUB_BITS = 3;
+    const unsigned SUB = 1u << SUB_BITS;
+    const unsigned MAX_BITS = 40;
+    const size_t BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB;
+
+    constexpr size_t bucket(uint64_t v) {
+      if (v < SUB) {
+        return v;
+      }
+      if (v >> MAX_BITS) {
+        return BUCKETS - 1;
+      }
+
+      unsigned msb = 63 - __builtin_clzll(v);
+      unsigned shift = msb - SUB_BITS;
+      return (shift + 1) * SUB + ((v >> shift) & (SUB - 1));
+    }
+
+    // Smallest value that lands in bucket b
+    constexpr uint64_t lower(size_t b) {
+      if (b < SUB) {
+        return b;
+      }
+      return static_cast<uint64_t>(SUB + b % SUB) << (b / SUB - 1);
+    }
+
+    static_assert(bucket(lower(200)) == 200, "histogram buckets are broken");
+    static_assert(bucket((1ull << MAX_BITS) - 1) == BUCKETS - 1, "histogram buckets are broken");
+  } // namespace hist
+
+  // Every thread writes its own shard with plain relaxed stores, so
+  // recording never takes a lock or bounces a cache line between cores.
+  // Shards of exited threads go back to a free list for the next thread.
+  struct Shard {
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+    std::atomic<uint64_t> buckets[TIMER_COUNT][hist::BUCKETS];
+    std::atomic<uint64_t> max[TIMER_COUNT];
+  };
+
+  Shard& local();
+
+  uint64_t now_ns();
+
+  // Only the owning thread writes a shard, so no read-modify-write needed
+  inline void bump(std::atomic<uint64_t>& a, uint64_t n) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  inline void count(Counter c, uint64_t n = 1) {
+    bump(local().counters[c], n);
+  }
+
+  inline void record(Timer t, uint64_t ns) {
+    Shard& s = local();
+    bump(s.buckets[t][hist::bucket(ns)], 1);
+    if (ns > s.max[t].load(std::memory_order_relaxed)) {
+      s.max[t].store(ns, std::memory_order_relaxed);
+    }
+  }
+
+  // Times whatever is left of the enclosing block
+  class Scope {
+    public:
+      explicit Scope(Timer t) : timer(t), start(now_ns()) {}
+      ~Scope() { record(timer, now_ns() - start); }
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+
+    private:
+      Timer timer;
+      uint64_t start;
+  };
+
+  // Adds up every shard. Counters first, then count, percentiles and max
+  // for every timer that has been hit, one per line.
+  std::string report();
+} // namespace metrics
+
+#endif
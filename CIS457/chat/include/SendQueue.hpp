@@ -0,0 +1,98 @@
+#ifndef CHAT_SEND_QUEUE_HPP
+#define CHAT_SEND_QUEUE_HPP
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <vector>
+
+namespace server {
+// Outbound frames for every connected socket. Handler threads only queue
+// frames, one flusher thread writes them out with sendmsg when the socket
+// is writable, so a slow reader never blocks whoever is talking to it.
+class SendQueue {
+  public:
+    // What happens to a client that falls behind by more than high_water bytes
+    enum Policy {
+      drop,
+      disconnect
+    };
+
+    // One encrypted frame, shared between every queue it was pushed to
+    typedef std::shared_ptr<const std::string> frame_ptr;
+
+    // With external set nothing is written here, whoever drives the sockets
+    // (the io_uring loop) pulls frames out with collect() instead
+    SendQueue(size_t high_water, Policy policy, bool external = false);
+    ~SendQueue();
+
+    // Starts tracking a socket, it belongs to the queue from now on
+    void add(int socket);
+
+    // Stops sending to a socket and closes it once the flusher lets go
+    void remove(int socket);
+
+    // Queues a frame, false if it was dropped or the client got cut off.
+    // Frames that must not be dropped disconnect the client instead.
+    bool push(int socket, frame_ptr frame, bool droppable = true);
+
+    // Most bytes a client may have queued before the policy kicks in
+    size_t limit() const { return high_water; }
+
+    // Flusher loop, never returns
+    static void* flusher(void* args);
+
+    // Wakes whoever is waiting on wake_fd()
+    void poke();
+    int wake_fd() const { return wake[0]; }
+
+    // External mode: sockets that got frames since the last call
+    void take_dirty(std::vector<int>& out);
+    // External mode: lends out up to max iovecs of queued frames, they stay
+    // put until complete() is called
+    size_t collect(int socket, iovec* iov, size_t max);
+    // External mode: sent bytes of the lent out frames made it, true if
+    // more frames are waiting
+    bool complete(int socket, size_t sent, bool failed);
+    // External mode: removed sockets with nothing in flight, for the caller
+    // to close
+    void take_closed(std::vector<int>& out);
+
+  private:
+    struct outbox {
+      std::deque<frame_ptr> frames;
+      // How much of frames.front() already went out
+      size_t offset = 0;
+      size_t bytes = 0;
+      // Shut down for falling behind or erroring, waiting on remove()
+      bool cut_off = false;
+      bool closing = false;
+      // Frames lent out through collect()
+      bool in_flight = false;
+    };
+
+    size_t high_water;
+    Policy policy;
+    bool external;
+    std::vector<int> dirty;
+
+    std::mutex lock;
+    std::unordered_map<int, outbox> boxes;
+
+    // Pipe used to wake the flusher when new work shows up
+    int wake[2];
+
+    // Writes as much as the socket takes, false if the socket is gone
+    bool flush(int socket, outbox& box);
+    // Throws away whatever is queued and shuts the socket down
+    void cut(int socket, outbox& box);
+    // Drops sent bytes worth of frames off the front
+    void advance(outbox& box, size_t sent);
+};
+} // namespace server
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef CHAT_URING_HPP
+#define CHAT_URING_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <vector>
+
+namespace uring {
+// Just enough io_uring for the chat server, straight on top of the
+// syscalls: one submission/completion ring pair and one provided buffer
+// ring for receives.
+class Ring {
+  public:
+    Ring() = default;
+    ~Ring();
+
+    Ring(const Ring&) = delete;
+    Ring& operator=(const Ring&) = delete;
+
+    // False if the kernel won't give us a ring
+    bool init(unsigned entries);
+    // IORING_FEAT_* the kernel reported from init
+    bool has_feature(unsigned feature) const { return (features & feature) != 0; }
+
+    // Next free submission slot, flushing to the kernel if we ran out
+    io_uring_sqe* get_sqe();
+
+    // Hands queued submissions to the kernel and waits for at least wait_nr
+    // completions
+    int submit_and_wait(unsigned wait_nr);
+
+    // Calls fn on every completion waiting in the ring and retires them
+    template <typename Fn>
+    unsigned for_each_cqe(Fn fn) {
+      unsigned head = *cq_head;
+      unsigned tail = reinterpret_cast<std::atomic<unsigned>*>(cq_tail)->load(std::memory_order_acquire);
+      unsigned seen = 0;
+
+      for (; head != tail; ++head, ++seen) {
+        fn(cqes[head & *cq_mask]);
+      }
+      reinterpret_cast<std::atomic<unsigned>*>(cq_head)->store(head, std::memory_order_release);
+
+      return seen;
+    }
+
+    // Registers count buffers of size bytes under group for BUFFER_SELECT,
+    // count has to be a power of two. Uses a provided buffer ring, or
+    // PROVIDE_BUFFERS where the ring turns out not to work.
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size);
+    char* buffer(uint16_t bid) { return buffers.data() + static_cast<size_t>(bid) * buffer_size; }
+    // Gives a buffer back to the kernel once we are done with its data.
+    // In fallback mode this queues a submission, completions with
+    // user_data 0 are failed recycles.
+    void recycle(uint16_t bid);
+    bool using_buffer_ring() const { return buf_ring != nullptr; }
+
+    // Tries a multishot accept and a multishot receive into the buffers
+    // from setup_buffers. Kernels that predate them turn the flags down
+    // with -EINVAL.
+    bool multishot_works();
+
+  private:
+    int fd = -1;
+    unsigned features = 0;
+
+    void* sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void* cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_entries = 0;
+    // Tail we have filled up to but not yet published
+    unsigned sqe_tail = 0;
+    unsigned sqe_head = 0;
+
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_buf_ring* buf_ring = nullptr;
+    uint16_t buf_group = 0;
+    size_t buf_ring_size = 0;
+    unsigned buf_entries = 0;
+    unsigned buffer_size = 0;
+    std::vector<char> buffers;
+
+    // Publishes filled SQEs, returns how many
+    unsigned flush_sq();
+    // Receives one byte over a socketpair to check the kernel hands out
+    // our buffers
+    bool buffers_work();
+    // Waits on the multishot request submitted as user_data, cancelling it
+    // if the kernel kept it going, and returns its first completion
+    io_uring_cqe probe(uint64_t user_data);
+};
+
+void prep_multishot_accept(io_uring_sqe* sqe, int fd, uint64_t user_data);
+void prep_multishot_recv(io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data);
+void prep_sendmsg(io_uring_sqe* sqe, int fd, const msghdr* msg, unsigned flags, uint64_t user_data);
+void prep_poll(io_uring_sqe* sqe, int fd, unsigned events, uint64_t user_data);
+// ts has to stay put until the timeout completes
+void prep_timeout(io_uring_sqe* sqe, const __kernel_timespec* ts, uint64_t user_data);
+// Cancels the request submitted with user_data target
+void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+} // namespace uring
+
+#endif
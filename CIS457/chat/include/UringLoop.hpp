@@ -0,0 +1,113 @@
+#ifndef CHAT_URING_LOOP_HPP
+#define CHAT_URING_LOOP_HPP
+
+#include "ChatServer.hpp"
+#include "SendQueue.hpp"
+#include "Uring.hpp"
+
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <sys/uio.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace server {
+// The io_uring backend. One thread owns every socket: a multishot accept
+// hands it new connections, a multishot recv per connection fills buffers
+// from a shared provided buffer ring, and queued frames go out as a chain of
+// linked sendmsg calls. RSA still runs on the handshake workers, the loop
+// just reads the hello for them and picks the user back up through joined().
+class UringLoop {
+  public:
+    UringLoop(ChatServer* server, int listen_socket);
+
+    // False if the kernel is too old or io_uring is switched off
+    bool init();
+
+    // Runs the loop, only returns if the ring breaks
+    void run();
+
+    // Called by handshake workers, the user is in users and the send queue
+    void joined(ChatServer::thread* t);
+    // Called by handshake workers when the hello was no good
+    void rejected(int socket);
+
+  private:
+    enum state {
+      hello,
+      // Hello is in, waiting on room in the handshake queue
+      waiting,
+      handshaking,
+      chatting
+    };
+
+    // iovecs lent out per connection and how many sendmsg calls they
+    // get split across, linked so they land in order
+    static const size_t MAX_IOV = 256;
+    static const size_t MAX_LINKS = 4;
+
+    struct connection {
+      uint32_t generation = 0;
+      state stage = hello;
+      time_t accepted = 0;
+      // Gone on the network side, waiting on the handshake or send queue
+      bool dead = false;
+      std::string inbuf;
+      // Key and username frame, kept until a worker takes them
+      std::string greeting;
+      ChatServer::thread user;
+
+      iovec iov[MAX_IOV];
+      msghdr msgs[MAX_LINKS];
+      size_t links = 0;
+      size_t finished = 0;
+      size_t sent = 0;
+      bool failed = false;
+    };
+
+    ChatServer* server;
+    int listen_socket;
+    uring::Ring ring;
+    uint32_t next_generation = 1;
+    std::unordered_map<int, connection> conns;
+    // The accept failed and gets armed again on the next tick
+    bool accept_backoff = false;
+
+    std::mutex handoff_lock;
+    std::vector<ChatServer::thread*> handoff_joined;
+    std::vector<int> handoff_rejected;
+
+    // Sockets with a hello and generation, oldest first
+    std::deque<std::pair<int, uint32_t>> waiting_list;
+    std::vector<int> scratch;
+    __kernel_timespec tick;
+
+    void arm_accept();
+    void arm_recv(int socket, const connection& c);
+    void arm_wake();
+    void arm_tick();
+
+    void on_accept(int res, bool more);
+    void on_recv(int socket, connection& c, int res, uint32_t flags);
+    void on_send(int socket, connection& c, int res);
+
+    // Runs whatever is buffered up for a connection
+    void consume(int socket, connection& c);
+    // Network side is done with this connection
+    void disconnect(int socket, connection& c);
+    void close_connection(int socket);
+    // Hands the hello to the handshake workers, false if they are swamped
+    bool offer(int socket, connection& c);
+    void start_send(int socket, connection& c);
+
+    // Handoffs, dirty and closed sockets from the send queue
+    void service();
+    void expire_hellos();
+};
+} // namespace server
+
+#endif
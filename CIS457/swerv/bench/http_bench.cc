@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// HTTP/1.1 load generator for swerver. Writes files of the requested sizes
+// into a temporary docroot, starts a swerver on it and hammers it from a
+// few threads, each running its own epoll loop over its share of the
+// connections, then reports requests/sec, throughput and latency
+// percentiles for every engine, mode and size. Each engine gets a fresh
+// server so they can be compared side by side.
+//
+//   swerv_bench [-server ./swerver] [-port 3200] [-threads 2]
+//               [-connections 32] [-seconds 5] [-sizes 1k,64k,1m]
+//               [-mode all|keepalive|close|pipeline] [-depth 16]
+//               [-engines epoll,uring] [-- extra swerver options]
+namespace {
+
+struct options {
+  std::string server = "./swerver";
+  int port = 3200;
+  int threads = 2;
+  int connections = 32;
+  int seconds = 5;
+  std::vector<size_t> sizes = { 1024, 64 * 1024, 1024 * 1024 };
+  std::string mode = "all";
+  int depth = 16;
+  std::vector<std::string> engines = { "epoll" };
+  std::vector<std::string> server_args;
+};
+
+enum Mode {
+  keepalive,
+  close_each,
+  pipeline
+};
+
+const char* mode_name(Mode mode) {
+  switch (mode) {
+    case keepalive: return "keepalive";
+    case close_each: return "close";
+    case pipeline: return "pipeline";
+  }
+  return "?";
+}
+
+uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double percentile(const std::vector<uint64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t i = std::min(sorted.size() - 1, static_cast<size_t>(p / 100.0 * sorted.size()));
+  return sorted[i] / 1e6;
+}
+
+std::vector<std::string> split(const std::string& list) {
+  std::vector<std::string> items;
+  size_t at = 0;
+  while (at < list.size()) {
+    size_t comma = list.find(',', at);
+    items.push_back(list.substr(at, comma == std::string::npos ? std::string::npos : comma - at));
+    at = comma == std::string::npos ? list.size() : comma + 1;
+  }
+  return items;
+}
+
+// 1k, 64k, 1m and plain byte counts
+bool parse_sizes(const std::string& list, std::vector<size_t>& sizes) {
+  sizes.clear();
+  for (const std::string& item : split(list)) {
+    char* end = nullptr;
+    size_t size = std::strtoull(item.c_str(), &end, 10);
+    if (end == item.c_str()) return false;
+    if (*end == 'k' || *end == 'K') size <<= 10;
+    else if (*end == 'm' || *end == 'M') size <<= 20;
+    else if (*end != '\0') return false;
+    sizes.push_back(size);
+  }
+  return !sizes.empty();
+}
+
+struct connection {
+  int fd = -1;
+  std::string in;
+  // Send times of the requests still waiting on a response, oldest first
+  std::vector<uint64_t> waiting;
+  size_t answered = 0;
+};
+
+struct results {
+  std::vector<uint64_t> latency;
+  uint64_t bytes = 0;
+  uint64_t errors = 0;
+};
+
+int open_connection(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Blocking connect, loopback answers right away
+  if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+// Pops every complete response off conn.in, false if one is garbage
+bool take_responses(connection& conn, results& out) {
+  for (;;) {
+    size_t head = conn.in.find("\r\n\r\n");
+    if (head == std::string::npos) return true;
+
+    size_t length = 0;
+    size_t at = 0;
+    while ((at = conn.in.find('\n', at)) != std::string::npos && at < head) {
+      ++at;
+      if (strncasecmp(conn.in.c_str() + at, "Content-Length:", 15) == 0) {
+        length = std::strtoull(conn.in.c_str() + at + 15, nullptr, 10);
+        break;
+      }
+    }
+
+    size_t total = head + 4 + length;
+    if (conn.in.size() < total) return true;
+    if (conn.waiting.empty() || conn.in.compare(0, 12, "HTTP/1.1 200") != 0) return false;
+
+    out.latency.push_back(now_ns() - conn.waiting.front());
+    out.bytes += length;
+    conn.waiting.erase(conn.waiting.begin());
+    conn.in.erase(0, total);
+    ++conn.answered;
+  }
+}
+
+class worker {
+  public:
+    worker(const options& opts, Mode mode, const std::string& request, int connections, uint64_t deadline)
+      : opts(opts), mode(mode), request(request), count(connections), deadline(deadline) {}
+
+    void run() {
+      epfd = epoll_create1(EPOLL_CLOEXEC);
+      conns.resize(count);
+      for (int i = 0; i < count; ++i) {
+        start(i);
+      }
+
+      epoll_event events[64];
+      while (now_ns() < deadline) {
+        int n = epoll_wait(epfd, events, 64, 50);
+        for (int i = 0; i < n; ++i) {
+          on_readable(events[i].data.u32);
+        }
+      }
+
+      for (auto& conn : conns) {
+        if (conn.fd >= 0) close(conn.fd);
+      }
+      close(epfd);
+    }
+
+    results out;
+
+  private:
+    const options& opts;
+    Mode mode;
+    const std::string& request;
+    int count;
+    uint64_t deadline;
+    int epfd = -1;
+    std::vector<connection> conns;
+
+    int batch() const {
+      return mode == pipeline ? opts.depth : 1;
+    }
+
+    void start(int i) {
+      connection& conn = conns[i];
+      conn = connection();
+      conn.fd = open_connection(opts.port);
+      if (conn.fd < 0) {
+        ++out.errors;
+        return;
+      }
+
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.u32 = i;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+      send_batch(conn);
+    }
+
+    void restart(int i) {
+      if (conns[i].fd >= 0) close(conns[i].fd);
+      conns[i].fd = -1;
+      if (now_ns() < deadline) start(i);
+    }
+
+    void send_batch(connection& conn) {
+      std::string data;
+      for (int i = 0; i < batch(); ++i) {
+        data += request;
+      }
+
+      uint64_t sent_at = now_ns();
+      size_t done = 0;
+      while (done < data.size()) {
+        ssize_t n = send(conn.fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n <= 0) {
+          ++out.errors;
+          return;
+        }
+        done += n;
+      }
+      conn.waiting.assign(batch(), sent_at);
+    }
+
+    void on_readable(int i) {
+      connection& conn = conns[i];
+      char buf[65536];
+
+      ssize_t n = recv(conn.fd, buf, sizeof(buf), 0);
+      if (n <= 0) {
+        // The server may close after answering a close request
+        if (!conn.waiting.empty()) ++out.errors;
+        restart(i);
+        return;
+      }
+      conn.in.append(buf, n);
+
+      if (!take_responses(conn, out)) {
+        ++out.errors;
+        restart(i);
+        return;
+      }
+
+      if (conn.waiting.empty()) {
+        if (mode == close_each) {
+          restart(i);
+        } else {
+          send_batch(conn);
+        }
+      }
+    }
+};
+
+bool write_docroot(const std::string& dir, const std::vector<size_t>& sizes) {
+  std::mt19937 rng(42);
+  for (size_t size : sizes) {
+    std::ofstream f(dir + "/f" + std::to_string(size) + ".txt", std::ios::binary);
+    std::string chunk(64 * 1024, ' ');
+    size_t left = size;
+    while (left > 0) {
+      for (auto& c : chunk) c = 'a' + rng() % 26;
+      size_t n = std::min(left, chunk.size());
+      f.write(chunk.data(), n);
+      left -= n;
+    }
+    if (!f.good()) return false;
+  }
+  return true;
+}
+
+pid_t start_server(const options& opts, const std::string& engine, const std::string& docroot) {
+  pid_t pid = fork();
+  if (pid != 0) {
+    return pid;
+  }
+
+  std::vector<std::string> args = {
+    opts.server, "-p", std::to_string(opts.port), "-docroot", docroot, "-logfile", docroot + "/.log",
+    "-engine", engine
+  };
+  args.insert(args.end(), opts.server_args.begin(), opts.server_args.end());
+
+  std::vector<char*> argv;
+  for (auto& arg : args) argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  // Keep the server's chatter out of the report
+  freopen("/dev/null", "w", stdout);
+  execv(argv[0], argv.data());
+  std::cerr << "Failed to run " << opts.server << ": " << std::strerror(errno) << std::endl;
+  _exit(1);
+}
+
+bool wait_for_server(int port) {
+  for (int i = 0; i < 100; ++i) {
+    int fd = open_connection(port);
+    if (fd >= 0) {
+      close(fd);
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return false;
+}
+
+void run(const options& opts, const std::string& engine, Mode mode, size_t size) {
+  std::string request = "GET /f" + std::to_string(size) + ".txt HTTP/1.1\r\nHost: localhost\r\n";
+  if (mode == close_each) {
+    request += "Connection: close\r\n";
+  }
+  request += "\r\n";
+
+  uint64_t began = now_ns();
+  uint64_t deadline = began + uint64_t(opts.seconds) * 1000000000ull;
+
+  std::vector<std::unique_ptr<worker>> workers;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < opts.threads; ++t) {
+    int share = opts.connections / opts.threads + (t < opts.connections % opts.threads ? 1 : 0);
+    workers.emplace_back(new worker(opts, mode, request, share, deadline));
+  }
+  for (auto& w : workers) {
+    threads.emplace_back([&w] { w->run(); });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  double elapsed = (now_ns() - began) / 1e9;
+
+  results total;
+  for (auto& w : workers) {
+    total.latency.insert(total.latency.end(), w->out.latency.begin(), w->out.latency.end());
+    total.bytes += w->out.bytes;
+    total.errors += w->out.errors;
+  }
+  std::sort(total.latency.begin(), total.latency.end());
+
+  std::cout << std::left << std::setw(7) << engine
+    << std::setw(10) << mode_name(mode)
+    << std::right << std::setw(9) << size
+    << std::setw(11) << std::fixed << std::setprecision(0) << total.latency.size() / elapsed
+    << std::setw(10) << std::setprecision(1) << total.bytes / elapsed / (1 << 20)
+    << std::setw(9) << std::setprecision(3) << percentile(total.latency, 50)
+    << std::setw(9) << percentile(total.latency, 90)
+    << std::setw(9) << percentile(total.latency, 99)
+    << std::setw(9) << (total.latency.empty() ? 0 : total.latency.back() / 1e6)
+    << std::setw(8) << total.errors << std::endl;
+}
+
+void usage() {
+  std::cout <<
+    "Usage: swerv_bench [-server PATH] [-port N] [-threads N] [-connections N]\n"
+    "                   [-seconds N] [-sizes 1k,64k,1m] [-depth N]\n"
+    "                   [-mode all|keepalive|close|pipeline] [-engines epoll,uring]\n"
+    "                   [-- swerver options]\n";
+}
+
+bool parse_args(int argc, char** argv, options& opts) {
+  for (int i = 1; i < argc; ++i) {
+    std::string opt(argv[i]);
+    if (opt == "--") {
+      opts.server_args.assign(argv + i + 1, argv + argc);
+      break;
+    }
+    if (i + 1 >= argc) return false;
+
+    std::string value(argv[++i]);
+    if (opt == "-server") opts.server = value;
+    else if (opt == "-port") opts.port = std::stoi(value);
+    else if (opt == "-threads") opts.threads = std::stoi(value);
+    else if (opt == "-connections") opts.connections = std::stoi(value);
+    else if (opt == "-seconds") opts.seconds = std::stoi(value);
+    else if (opt == "-depth") opts.depth = std::stoi(value);
+    else if (opt == "-mode") opts.mode = value;
+    else if (opt == "-engines") opts.engines = split(value);
+    else if (opt == "-sizes") {
+      if (!parse_sizes(value, opts.sizes)) return false;
+    } else {
+      return false;
+    }
+  }
+
+  return !opts.engines.empty() && opts.threads > 0 && opts.connections >= opts.threads && opts.seconds > 0 && opts.depth > 0;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  options opts;
+  if (!parse_args(argc, argv, opts)) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  std::vector<Mode> modes;
+  if (opts.mode == "all" || opts.mode == "keepalive") modes.push_back(keepalive);
+  if (opts.mode == "all" || opts.mode == "close") modes.push_back(close_each);
+  if (opts.mode == "all" || opts.mode == "pipeline") modes.push_back(pipeline);
+  if (modes.empty()) {
+    usage();
+    return EXIT_FAILURE;
+  }
+
+  char dir_template[] = "/tmp/swerv_bench.XXXXXX";
+  if (mkdtemp(dir_template) == nullptr) {
+    std::cerr << "Failed to make a temporary docroot" << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::string docroot(dir_template);
+
+  int status = EXIT_SUCCESS;
+  if (!write_docroot(docroot, opts.sizes)) {
+    std::cerr << "Failed to write files to " << docroot << std::endl;
+    status = EXIT_FAILURE;
+  } else {
+    std::cout << opts.threads << " threads, " << opts.connections << " connections, "
+      << opts.seconds << "s per run" << std::endl;
+    std::cout << std::left << std::setw(7) << "engine"
+      << std::setw(10) << "mode"
+      << std::right << std::setw(9) << "size"
+      << std::setw(11) << "req/s"
+      << std::setw(10) << "MB/s"
+      << std::setw(9) << "p50 ms"
+      << std::setw(9) << "p90 ms"
+      << std::setw(9) << "p99 ms"
+      << std::setw(9) << "max ms"
+      << std::setw(8) << "errors" << std::endl;
+  }
+
+  for (size_t e = 0; status == EXIT_SUCCESS && e < opts.engines.size(); ++e) {
+    const std::string& engine = opts.engines[e];
+    pid_t server = start_server(opts, engine, docroot);
+    if (server < 0 || !wait_for_server(opts.port)) {
+      std::cerr << "swerver didn't come up on port " << opts.port << " with " << engine << std::endl;
+      status = EXIT_FAILURE;
+    } else {
+      for (Mode mode : modes) {
+        for (size_t size : opts.sizes) {
+          run(opts, engine, mode, size);
+        }
+      }
+    }
+
+    if (server > 0) {
+      kill(server, SIGTERM);
+      waitpid(server, nullptr, 0);
+    }
+  }
+
+  std::error_code ec;
+  std::filesystem::remove_all(docroot, ec);
+
+  return status;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace swerver {
+  // Access log in Common Log Format. Each worker thread appends lines to
+  // its own ring without taking a lock or making a syscall, and a
+  // background thread drains all the rings into the file a batch at a time
+  // and rotates it when it grows too big. If a ring fills up faster than
+  // it drains, lines are dropped and counted rather than blocking a worker.
+  class AccessLog {
+    public:
+      // Writes to dir/access.log, keeping keep old files of up to max_size
+      AccessLog(std::string dir, size_t max_size, int keep);
+      // Writes out whatever is still queued and stops the writer. Nothing
+      // may log by then.
+      ~AccessLog();
+
+      AccessLog(const AccessLog&) = delete;
+      AccessLog& operator=(const AccessLog&) = delete;
+
+      // Opens the file and starts the writer thread
+      bool start();
+
+      // Queues a line from the calling thread, newline included
+      void write(const std::string& line);
+
+    private:
+      // Single producer, single consumer byte ring
+      struct Ring {
+        static const size_t SIZE = 1 << 20;
+        std::unique_ptr<char[]> data{new char[SIZE]};
+        // Both only grow, the index into data is modulo SIZE
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+      };
+
+      std::string path;
+      size_t max_size;
+      int keep;
+      int fd = -1;
+      size_t size = 0;
+      pthread_t writer;
+      bool started = false;
+      std::atomic<bool> stopping{false};
+
+      // Only taken when a thread logs for the first time and by the writer
+      std::mutex rings_lock;
+      std::vector<std::unique_ptr<Ring>> rings;
+
+      Ring* ring();
+      static void* serve(void* args);
+      // Moves everything queued into batch
+      void drain(std::string& batch);
+      void flush(const std::string& batch);
+      bool open_file();
+      void rotate();
+  };
+} // namespace swerver
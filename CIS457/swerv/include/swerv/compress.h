@@ -0,0 +1,8 @@
+#pragma once
+
+#include <string>
+
+namespace swerver {
+  // gzips in into out at the best compression level, false if zlib fails
+  bool gzip(const std::string& in, std::string& out);
+} // namespace swerver
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <swerv/http_parser.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace swerver {
+  // A body produced as it is sent, for when it's generated or its length
+  // isn't known up front. It is asked for one bounded chunk at a time, only
+  // once the previous one is on the socket, so it costs the same memory
+  // however long it runs.
+  class Stream {
+    public:
+      virtual ~Stream() = default;
+
+      // Appends up to max bytes of body to out. False once the body is
+      // finished, out may still have got its last bytes.
+      virtual bool read(std::string& out, size_t max) = 0;
+  };
+
+  // A piece of response waiting on the socket: bytes we built, bytes that
+  // belong to someone else and are kept alive by owner, a range of an open
+  // file that goes out with sendfile and never touches user space, or a
+  // stream whose current chunk sits in data. File pieces own their
+  // descriptor.
+  struct Segment {
+    std::string data;
+    std::unique_ptr<Stream> stream;
+    // Frame the stream as Transfer-Encoding: chunked
+    bool chunked = false;
+    std::shared_ptr<const void> owner;
+    const char* shared = nullptr;
+    size_t shared_length = 0;
+    int fd = -1;
+    off_t offset = 0;
+    size_t length = 0;
+
+    Segment() = default;
+    ~Segment();
+    Segment(Segment&& other) noexcept;
+    Segment& operator=(Segment&& other) noexcept;
+    Segment(const Segment&) = delete;
+    Segment& operator=(const Segment&) = delete;
+
+    bool is_file() const { return fd >= 0; }
+    bool is_shared() const { return shared != nullptr; }
+    bool is_stream() const { return stream != nullptr; }
+
+    // Replaces data with the stream's next chunk. Once the stream is done
+    // the segment turns into plain bytes holding whatever is left.
+    void next_chunk();
+    std::string_view bytes() const {
+      return is_shared() ? std::string_view(shared, shared_length) : std::string_view(data);
+    }
+  };
+
+  // Everything a connection costs between requests: the socket and
+  // whatever is buffered either way
+  struct Connection {
+    int socket = -1;
+    // Client address, for the access log
+    std::string peer;
+
+    // Bytes read but not yet handled, and how far into them we are
+    std::string in;
+    RequestParser parser;
+
+    // Response pieces waiting on the socket, in order. data_offset is how
+    // far into the front piece we are when it is bytes.
+    std::deque<Segment> out;
+    size_t data_offset = 0;
+
+    // Close once out drains
+    bool closing = false;
+    // Requests wait unparsed in in until out drains, and nothing more
+    // is read meanwhile
+    bool paused = false;
+
+    // Status and body size of the last response queued, for the access log
+    int status = 0;
+    size_t body_bytes = 0;
+
+    // What epoll is watching for right now
+    uint32_t events = 0;
+
+    // What the connection is waiting on, each with its own timeout
+    enum Wait {
+      waiting_idle,
+      waiting_head,
+      waiting_body,
+      waiting_send
+    };
+
+    // Tells this connection apart from an earlier one on the same socket
+    uint64_t id = 0;
+    Wait wait = waiting_idle;
+    // When the current wait runs out, and the second the timer wheel will
+    // look at us, 0 if it won't
+    time_t deadline = 0;
+    time_t timer = 0;
+    // Set when the socket took some of out, cleared by update_deadline
+    bool wrote = false;
+
+    bool want_write() const { return !out.empty(); }
+    // Too much response is queued to take on more requests, so a client
+    // pipelining without reading can't have every file opened at once
+    bool backed_up() const;
+
+    // Works out what we wait on after the last event. Deadlines for the
+    // head and body of a request run from when they started, so trickling
+    // bytes doesn't buy time. A send's moves on whenever the client takes
+    // some of it.
+    void update_deadline(time_t now, bool writing);
+
+    // Queues bytes, joining them onto the last piece when we can
+    void write(const std::string& data);
+    // Queues length bytes at data without copying them. owner keeps them
+    // alive until they are sent, null if they outlive the connection.
+    void write_shared(std::shared_ptr<const void> owner, const char* data, size_t length);
+    // Queues a body that is read as it is sent
+    void write_stream(std::unique_ptr<Stream> stream, bool chunked);
+    // Queues length bytes of fd from offset and takes ownership of fd
+    void write_file(int fd, off_t offset, size_t length);
+
+    // Moves the front stream on to its next chunk once the current one is
+    // out. True if out changed and the front needs another look.
+    bool advance_stream();
+    // Points iov at the run of byte pieces at the front of out that can go
+    // in one gathered write, returns how many. Stops at a file, and a
+    // stream only ever goes alone.
+    int gather(iovec* iov, int max) const;
+    // Retires sent bytes of what gather handed out
+    void consume(size_t sent);
+  };
+
+  // Printable address of a client, "-" if it's not IP
+  std::string peer_name(const sockaddr_storage& addr);
+} // namespace swerver
@@ -1,27 +1,43 @@
 #pragma once
 
+#include <swerv/access_log.h>
+#include <swerv/connection.h>
+#include <swerv/file_cache.h>
+#include <swerv/mime.h>
+
+#include <atomic>
+#include <ctime>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
 
 namespace swerver {
   class Core {
     public:
-      enum ContentType {
-        text,
-        html,
-        jpeg,
-        pdf
-      };
-
       Core() = default;
       ~Core() = default;
 
       int Run(int argc, char** argv);
 
-      struct thread {
-        int socket;
-        // To access our goodies
-        Core* instance;
-      };
+      // Answers every complete request buffered on conn, appending the
+      // responses to conn.out. Stops early and sets conn.paused once
+      // conn.out is backed up; call it again when that has drained. Called
+      // from the worker that owns conn.
+      void handle_requests(Connection& conn);
+
+      // Counts a new connection against -maxconn across all workers, false
+      // if we are full. Every admitted connection is released once.
+      bool admit();
+      void release();
+      bool has_room() const;
+
+      // Set by SIGTERM or SIGINT. Workers stop accepting, finish the
+      // responses they owe and return from run.
+      static bool draining();
     private:
       const std::string html404 =
         R"(
@@ -59,7 +75,19 @@ namespace swerver {
           </body>
           </html>
         )";
-      const std::string html200Failed =
+      const std::string html403 =
+        R"(
+          <!DOCTYPE html>
+          <html>
+          <title>403!</title>
+          <body>
+          <h1>
+          You don't have permission to read that.
+          </h1>
+          </body>
+          </html>
+        )";
+      const std::string html500 =
         R"(
           <!DOCTYPE html>
           <html>
@@ -86,28 +114,118 @@ namespace swerver {
       std::string docroot = ".doc";
       std::string logfile = ".log";
       int port = 3000;
+      int workers = 0;
+      // 0 is half of what RLIMIT_NOFILE allows, the rest is for files
+      int max_connections = 0;
+      std::atomic<int> open_connections{0};
+      // What the workers wait on, epoll or uring
+      std::string engine = "epoll";
+      int cache_mb = 64;
+      std::unique_ptr<FileCache> cache;
+      std::unique_ptr<AccessLog> access_log;
+      MimeTypes mime_types;
 
-      static void* thread_handler(void* args);
       void usage() const;
+      // Offset and length of a piece of a file
+      using ByteRange = std::pair<size_t, size_t>;
+
+      void handle_get(const Request& request, Connection& conn);
+      // Streams an index of the directory open on fd, which it takes over
+      void send_directory(const Request& request, Connection& conn, int fd, std::string req) const;
+      // Queues a header and a body of unknown length, chunked unless the
+      // client is HTTP/1.0
+      void send_stream_response(
+          const Request& request,
+          Connection& conn,
+          int code,
+          std::string_view content_type,
+          std::unique_ptr<Stream> body) const;
+      // Undoes %XX escapes, false on a bad one
+      static bool percent_decode(std::string_view in, std::string& out);
+      // -1 unless path opens and is a regular file
+      static int open_regular(const std::string& path, struct stat& info);
+      // Which of ENCODING_GZIP and ENCODING_BR the client takes
+      static int accepted_encodings(const Request& request);
+      void serve_cached(const Request& request, Connection& conn, std::shared_ptr<const CachedFile> file) const;
+      void send_not_modified(
+          Connection& conn,
+          bool keep_alive,
+          const std::string& etag,
+          const std::string& last_modified) const;
+      // Which part of a size byte file to send: 200 for all of it, 206 with
+      // ranges filled in, or 416 when none of the ranges asked for exist
+      int select_ranges(
+          const Request& request,
+          size_t size,
+          const std::string& etag,
+          const std::string& last_modified,
+          std::vector<ByteRange>& ranges) const;
+      // Queues a 206 or 416, body queues the bytes of one range
+      void send_ranges(
+          Connection& conn,
+          bool keep_alive,
+          int code,
+          std::string_view content_type,
+          size_t size,
+          const std::string& last_modified,
+          const std::string& etag,
+          const std::string& encoding,
+          const std::vector<ByteRange>& ranges,
+          const std::function<void(size_t, size_t)>& body) const;
+      int make_listener() const;
       void send_http_response(
-          int socket,
+          Connection& conn,
           int code,
           bool keep_alive,
-          Core::ContentType content_type,
+          std::string_view content_type,
           std::string filename,
           std::string last_modified,
           std::string file_data) const;
-      void log_request(std::string log);
+      // Queues the header and then size bytes of fd, which conn takes over
+      void send_file_response(
+          Connection& conn,
+          bool keep_alive,
+          std::string_view content_type,
+          std::string filename,
+          std::string last_modified,
+          std::string etag,
+          std::string encoding,
+          int fd,
+          size_t size) const;
+      void send_cached_response(Connection& conn, bool keep_alive, std::shared_ptr<const CachedFile> file) const;
+      std::string make_header(
+          int code,
+          bool keep_alive,
+          std::string_view content_type,
+          std::string filename,
+          std::string last_modified,
+          std::string etag,
+          size_t content_length) const;
+      // Status line and the headers that change per response
+      std::string make_status(int code, bool keep_alive) const;
+      static const std::string& date_header();
+      // Headers that only depend on the file
+      std::string make_entity_headers(
+          std::string_view content_type,
+          std::string filename,
+          std::string last_modified,
+          std::string etag,
+          std::string encoding,
+          size_t content_length) const;
+      void log_request(const Connection& conn, const Request& request);
 
-      std::string check_file_mod(std::string path);
+      static std::string http_date(time_t t);
+      static std::string make_etag(const struct stat& info);
+      static bool read_all(int fd, size_t size, std::string& out);
       std::string get_current_time();
-      std::string modded_since(std::string req, std::string filename, std::string ext);
-      std::string read_file(std::string filename) const;
+      // False when the request's validators say the client's copy is current
+      bool modded_since(const Request& request, const std::string& etag, time_t mtime) const;
+      // -1 if it isn't one of the three HTTP date formats
+      static time_t parse_http_date(std::string_view date);
       std::string make_path(std::string dir, std::string file) const;
 
       bool init_system_file(std::string path, std::string default_path);
       bool handle_args(int argc, char** argv);
 
-      Core::ContentType make_content_type(std::string ext);
   };
 } // namespace swerver
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <swerv/connection.h>
+
+#include <dirent.h>
+#include <string>
+
+namespace swerver {
+  // Streams an HTML index of a directory one entry at a time, so even a
+  // directory with millions of files only ever holds a chunk of it
+  class DirectoryListing : public Stream {
+    public:
+      // dir is opened already, href is where it lives in URL space
+      DirectoryListing(DIR* dir, std::string href);
+      ~DirectoryListing() override;
+
+      bool read(std::string& out, size_t max) override;
+
+    private:
+      DIR* dir;
+      std::string href;
+      bool started = false;
+
+      static void append_html(std::string& out, const std::string& text);
+      static void append_url(std::string& out, const std::string& text);
+  };
+} // namespace swerver
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace swerver {
+  // A small file ready to go out: everything in the header that doesn't
+  // change between requests, and the body
+  struct CachedFile {
+    std::string content_type;
+    time_t mtime = 0;
+    std::string etag;
+    // Content-Encoding, empty for none
+    std::string encoding;
+    std::string last_modified;
+    // Header lines after Connection, without the blank line
+    std::string headers;
+    std::string body;
+  };
+
+  // Byte bounded LRU of small files under the docroot, shared by every
+  // worker. Nothing here is ever stat'ed again; instead inotify watches each
+  // directory of the docroot and drops entries as soon as they change.
+  // A file is only cached if its directory is being watched, so a missed
+  // watch costs hits, never freshness.
+  class FileCache {
+    public:
+      FileCache(std::string root, size_t capacity, size_t max_entry);
+
+      FileCache(const FileCache&) = delete;
+      FileCache& operator=(const FileCache&) = delete;
+
+      // Watches the docroot and starts the thread reading inotify. False if
+      // inotify won't have us, in which case nothing gets cached. The cache
+      // must outlive the process from then on.
+      bool start();
+
+      // Files are cached once for each set of encodings a client takes:
+      // under path for clients that take none, and under key(path, "br"),
+      // key(path, "gzip") and key(path, "br,gzip") for the rest
+      static std::string key(const std::string& path, const std::string& encodings);
+
+      std::shared_ptr<const CachedFile> find(const std::string& key);
+
+      // Whether the file opened at path, info being its fstat, would be
+      // kept. inotify reports a change under the name it was made through,
+      // so only a regular file with no other name than path qualifies; one
+      // behind a symlink or with more hard links could go stale.
+      bool cacheable(const std::string& path, const struct stat& info);
+
+      // Take this before reading the file and hand it to insert, so a
+      // change that lands while we read isn't cached over
+      uint64_t generation();
+      void insert(const std::string& path, std::shared_ptr<const CachedFile> file, uint64_t generation);
+
+    private:
+      using Entry = std::pair<std::string, std::shared_ptr<const CachedFile>>;
+
+      std::string root;
+      size_t capacity;
+      size_t max_entry;
+      int notify = -1;
+
+      std::mutex lock;
+      // Most recent at the front
+      std::list<Entry> lru;
+      std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+      size_t used = 0;
+      uint64_t changes = 0;
+      std::unordered_map<int, std::string> watches;
+      std::unordered_set<std::string> watched;
+
+      static void* serve(void* args);
+      void handle_events(const char* buf, size_t len);
+      // Both take lock themselves
+      void watch_tree(const std::string& dir);
+      void forget_tree(const std::string& dir);
+      // Drops path, or everything under it ending in '/', lock held
+      void invalidate(const std::string& path);
+      void clear();
+      void evict(std::list<Entry>::iterator it);
+  };
+} // namespace swerver
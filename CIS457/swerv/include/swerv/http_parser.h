@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace swerver {
+  // One parsed request. The views point into the connection's read buffer
+  // and are good until the request is consumed.
+  struct Request {
+    std::string_view method;
+    std::string_view target;
+    std::string_view version;
+    std::vector<std::pair<std::string_view, std::string_view>> headers;
+    // The request line and headers as they came in
+    std::string_view head;
+    bool keep_alive = true;
+
+    // Case-insensitive, empty if it wasn't sent
+    std::string_view header(std::string_view name) const;
+  };
+
+  // Incremental HTTP/1.1 request parser. Feed it the same growing buffer
+  // each time more arrives and it picks up where it stopped, so nothing is
+  // scanned twice and requests split across reads or packed into one read
+  // both work. Nothing is copied; offsets are kept until the request is
+  // complete and only then turned into views.
+  class RequestParser {
+    public:
+      enum Status {
+        incomplete,
+        done,
+        bad
+      };
+
+      // Parses the request starting at buf[start]
+      Status parse(const std::string& buf, size_t start);
+
+      // Valid after done
+      const Request& request() const { return this->req; }
+      // Bytes the request took up from start, counting blank lines before
+      // it and what body had come
+      size_t consumed() const { return this->end - this->origin; }
+      // The last request was answered and we are waiting on the rest of
+      // its body
+      bool in_body() const { return this->state == body; }
+
+      // Ready for the next request
+      void reset();
+
+      // Drops body bytes left over from the last request. Call it with how
+      // many bytes follow start before each parse; it returns how many of
+      // those to skip. The next request can't start while in_body().
+      size_t skip_body(size_t have);
+
+      // The caller dropped n bytes from the front of buf, all before the
+      // request we are partway through
+      void shift(size_t n);
+
+    private:
+      enum State {
+        request_line,
+        header_lines,
+        body
+      };
+
+      // Anything bigger than this before the blank line is refused
+      static const size_t MAX_HEAD = 16 * 1024;
+
+      bool fresh = true;
+      State state = request_line;
+      // Where parse was told to start, and where the request line starts
+      // once any blank lines before it are skipped
+      size_t origin = 0;
+      size_t start = 0;
+      size_t pos = 0;
+      size_t head_end = 0;
+      size_t end = 0;
+      size_t body_left = 0;
+
+      // Offsets and lengths into buf
+      std::pair<size_t, size_t> method, target, version;
+      std::vector<std::pair<std::pair<size_t, size_t>, std::pair<size_t, size_t>>> fields;
+
+      Request req;
+
+      bool on_request_line(const std::string& buf, size_t from, size_t to);
+      bool on_header_line(const std::string& buf, size_t from, size_t to);
+      bool finish_head(const std::string& buf);
+      void make_request(const std::string& buf);
+  };
+} // namespace swerver
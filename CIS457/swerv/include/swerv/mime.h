@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace swerver {
+  namespace mime {
+    struct Entry {
+      std::string_view extension;
+      std::string_view type;
+    };
+
+    constexpr char lower(char c) {
+      return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    constexpr bool equals_nocase(std::string_view a, std::string_view b) {
+      if (a.size() != b.size()) return false;
+      for (size_t i = 0; i < a.size(); ++i) {
+        if (lower(a[i]) != lower(b[i])) return false;
+      }
+      return true;
+    }
+
+    // FNV-1a over the lowercased extension, seeded so a table can look for
+    // a seed that gives every entry its own slot
+    constexpr uint32_t hash(std::string_view extension, uint32_t seed) {
+      uint32_t h = 2166136261u ^ seed;
+      for (char c : extension) {
+        h ^= static_cast<unsigned char>(lower(c));
+        h *= 16777619u;
+      }
+      return h;
+    }
+
+    // Whatever follows the last dot of the last path segment, found in one
+    // pass from the end. Empty for no extension.
+    constexpr std::string_view extension(std::string_view path) {
+      for (size_t i = path.size(); i > 0; --i) {
+        char c = path[i - 1];
+        if (c == '.') return path.substr(i);
+        if (c == '/') break;
+      }
+      return std::string_view();
+    }
+
+    namespace detail {
+      constexpr Entry builtin[] = {
+        {"html", "text/html"},
+        {"htm", "text/html"},
+        {"txt", "text/plain"},
+        {"css", "text/css"},
+        {"csv", "text/csv"},
+        {"md", "text/markdown"},
+        {"js", "application/javascript"},
+        {"mjs", "application/javascript"},
+        {"json", "application/json"},
+        {"xml", "application/xml"},
+        {"pdf", "application/pdf"},
+        {"zip", "application/zip"},
+        {"gz", "application/gzip"},
+        {"tar", "application/x-tar"},
+        {"wasm", "application/wasm"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"png", "image/png"},
+        {"gif", "image/gif"},
+        {"webp", "image/webp"},
+        {"svg", "image/svg+xml"},
+        {"ico", "image/x-icon"},
+        {"bmp", "image/bmp"},
+        {"avif", "image/avif"},
+        {"mp3", "audio/mpeg"},
+        {"ogg", "audio/ogg"},
+        {"wav", "audio/wav"},
+        {"mp4", "video/mp4"},
+        {"webm", "video/webm"},
+        {"woff", "font/woff"},
+        {"woff2", "font/woff2"},
+        {"ttf", "font/ttf"},
+        {"otf", "font/otf"}
+      };
+
+      constexpr size_t BUILTIN_SLOTS = 128;
+
+      constexpr bool fits(uint32_t seed) {
+        bool taken[BUILTIN_SLOTS] = {};
+        for (const auto& e : builtin) {
+          size_t slot = hash(e.extension, seed) % BUILTIN_SLOTS;
+          if (taken[slot]) return false;
+          taken[slot] = true;
+        }
+        return true;
+      }
+
+      constexpr uint32_t find_seed() {
+        uint32_t seed = 0;
+        while (!fits(seed)) ++seed;
+        return seed;
+      }
+
+      constexpr uint32_t BUILTIN_SEED = find_seed();
+
+      struct table {
+        Entry slots[BUILTIN_SLOTS] = {};
+
+        constexpr table() {
+          for (const auto& e : builtin) {
+            slots[hash(e.extension, BUILTIN_SEED) % BUILTIN_SLOTS] = e;
+          }
+        }
+      };
+
+      constexpr table BUILTIN{};
+    } // namespace detail
+
+    // Types we know without being told, one probe and one compare. Empty
+    // if the extension isn't one of them.
+    constexpr std::string_view builtin_type(std::string_view extension) {
+      if (extension.empty()) return std::string_view();
+
+      const Entry& e = detail::BUILTIN.slots[hash(extension, detail::BUILTIN_SEED) % detail::BUILTIN_SLOTS];
+      return equals_nocase(e.extension, extension) ? e.type : std::string_view();
+    }
+
+    static_assert(builtin_type("JPG") == "image/jpeg", "mime table is broken");
+    static_assert(builtin_type("jp") == "", "mime table is broken");
+    static_assert(extension("/a.b/c.tar.gz") == "gz" && extension("/a.b/c") == "", "extension() is broken");
+  } // namespace mime
+
+  // Extension to MIME type. The built in table covers the common types,
+  // and a mime.types file can add to it or override it; that part goes in an
+  // open addressed table kept at most half full. Lookups never allocate.
+  class MimeTypes {
+    public:
+      // Reads "type ext ext ..." lines, false if the file can't be opened
+      bool load(const std::string& path);
+
+      std::string_view lookup(std::string_view path) const;
+
+      // Worth gzipping
+      static bool compressible(std::string_view type);
+
+    private:
+      // Loaded extensions and types live here and the table points into it
+      std::deque<std::string> storage;
+      std::vector<mime::Entry> slots;
+  };
+} // namespace swerver
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <swerv/connection.h>
+#include <swerv/timer_wheel.h>
+#include <swerv/worker.h>
+
+#include <cstdint>
+#include <ctime>
+#include <unordered_map>
+
+namespace swerver {
+  class Core;
+
+  // A worker loop on a level-triggered epoll set
+  class Reactor : public Worker {
+    public:
+      Reactor(Core* core, int listen_socket);
+      ~Reactor() override;
+
+      Reactor(const Reactor&) = delete;
+      Reactor& operator=(const Reactor&) = delete;
+
+      bool init() override;
+      void run() override;
+
+    private:
+      Core* core;
+      int listener;
+      int epfd = -1;
+      std::unordered_map<int, Connection> conns;
+      TimerWheel wheel;
+      uint64_t next_id = 0;
+      // Monotonic second of the current wakeup, and of the last tick
+      time_t now = 0;
+      time_t last_tick = 0;
+
+      // Whether the listener is in the epoll set, and when it may go back
+      bool accepting = true;
+      time_t resume_at = 0;
+
+      bool draining = false;
+      time_t drain_deadline = 0;
+
+      void accept_all();
+      // Takes the listener out of the epoll set until until, and after
+      // that until Core has room again
+      void pause_accepting(time_t until);
+      void resume_accepting();
+      // Once a second: timeouts, accept backoff and draining. False once
+      // the worker is done.
+      bool tick();
+      // Stops accepting, closes idle connections and lets the rest finish
+      void drain();
+      // Reads and handles whatever arrived, false if the socket broke
+      bool on_readable(Connection& conn);
+      // Writes what the socket takes, false if the connection is done
+      bool flush(Connection& conn);
+      // Watches for EPOLLOUT only while there is something to write, and
+      // moves the connection's deadline along
+      void update(Connection& conn);
+      void close_connection(int socket);
+  };
+} // namespace swerver
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <swerv/connection.h>
+
+#include <algorithm>
+#include <ctime>
+#include <vector>
+
+namespace swerver {
+  // Hashed timer wheel of one second slots, one per worker. Every
+  // connection has at most one entry, filed under the second it has to be
+  // looked at. Moving a deadline later costs nothing: the entry comes due,
+  // sees the connection has more time and is filed again. Only a deadline
+  // that moves earlier needs a new entry, and the one it replaces is
+  // recognized as stale and dropped.
+  class TimerWheel {
+    public:
+      TimerWheel();
+
+      // Seconds on the monotonic clock, the wheel's only notion of time
+      static time_t now();
+
+      // Makes sure conn is looked at by its deadline
+      void watch(Connection& conn);
+
+      // Walks every slot up to now. lookup(socket) is the live connection
+      // behind an entry or null, expire(conn) is called for each one past
+      // its deadline and may close it.
+      template <typename Lookup, typename Expire>
+      void advance(time_t now, Lookup lookup, Expire expire) {
+        if (this->current == 0 || now - this->current >= time_t(SLOTS)) {
+          // First tick, or we slept through a whole turn and every slot is due
+          this->current = std::max(this->current, now - time_t(SLOTS) + 1);
+        }
+
+        std::vector<Entry> due;
+        for (; this->current <= now; ++this->current) {
+          std::vector<Entry>& slot = this->slots[this->current % SLOTS];
+          due.clear();
+          due.swap(slot);
+
+          for (const Entry& entry : due) {
+            // A later turn of the wheel
+            if (entry.when > now) {
+              slot.push_back(entry);
+              continue;
+            }
+
+            Connection* conn = lookup(entry.socket);
+            if (conn == nullptr || conn->id != entry.id || conn->timer != entry.when) continue;
+
+            conn->timer = 0;
+            if (conn->deadline > now) {
+              watch(*conn);
+            } else {
+              expire(*conn);
+            }
+          }
+        }
+      }
+
+    private:
+      static const size_t SLOTS = 64;
+
+      struct Entry {
+        int socket;
+        uint64_t id;
+        time_t when;
+      };
+
+      std::vector<std::vector<Entry>> slots;
+      // Next second to walk
+      time_t current = 0;
+  };
+} // namespace swerver
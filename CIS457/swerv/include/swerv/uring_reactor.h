@@ -0,0 +1,105 @@
+#pragma once
+
+#include <swerv/connection.h>
+#include <swerv/timer_wheel.h>
+#include <swerv/uring.h>
+#include <swerv/worker.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unordered_map>
+
+namespace swerver {
+  class Core;
+
+  // A worker loop on io_uring. Accepts and receives are multishot into
+  // provided buffers, sockets sit in the ring's registered file table, and
+  // file bodies are spliced through a pipe so they never touch user space.
+  // Each connection has at most one receive and one write in flight.
+  class UringReactor : public Worker {
+    public:
+      UringReactor(Core* core, int listen_socket);
+      ~UringReactor() override;
+
+      bool init() override;
+      void run() override;
+
+    private:
+      // Byte pieces gathered into a single sendmsg
+      static const int MAX_IOV = 64;
+
+      // A connection and what the ring is doing with it. The kernel holds
+      // on to msg and iov while a send is in flight, so a session stays put
+      // until its last completion is in.
+      struct Session {
+        Connection conn;
+        // Socket is in the registered table at its own number
+        bool fixed = false;
+        bool receiving = false;
+        bool sending = false;
+        // Shut down, waiting on the ring before it is freed
+        bool done = false;
+        // File bytes spliced into the pipe but not yet out of it
+        int pipe[2] = { -1, -1 };
+        size_t piped = 0;
+        msghdr msg = {};
+        iovec iov[MAX_IOV];
+      };
+
+      Core* core;
+      int listener;
+      uring::Ring ring;
+      std::unordered_map<int, Session> sessions;
+      TimerWheel wheel;
+      uint64_t next_id = 0;
+      // Monotonic second of the current wakeup, and of the last tick
+      time_t now = 0;
+      time_t last_tick = 0;
+      // Wakes the loop once a second when nothing else does
+      __kernel_timespec tick_interval = { 1, 0 };
+
+      // Whether we want connections, whether a multishot accept is in the
+      // kernel, and when accepting may start again
+      bool accepting = true;
+      bool accept_armed = false;
+      time_t resume_at = 0;
+
+      bool draining = false;
+      bool forced = false;
+      time_t drain_deadline = 0;
+
+      void arm_accept();
+      void arm_tick();
+      // Cancels the multishot accept until until, and after that until
+      // Core has room again
+      void pause_accepting(time_t until);
+      void resume_accepting();
+      // Once a second: timeouts, accept backoff and draining. False once
+      // the worker is done.
+      bool tick();
+      // Stops accepting, shuts idle connections and lets the rest finish
+      void drain();
+      bool arm_recv(Session& session);
+      // Cancels the multishot receive while requests are held back
+      void stop_recv(Session& session);
+      void on_accept(const io_uring_cqe& cqe);
+      void on_recv(Session& session, const io_uring_cqe& cqe);
+      void on_send(Session& session, const io_uring_cqe& cqe);
+      void on_splice_in(Session& session, const io_uring_cqe& cqe);
+      void on_splice_out(Session& session, const io_uring_cqe& cqe);
+      // Starts the next write unless one is in flight, shuts the session
+      // once a closing connection has drained
+      void flush(Session& session);
+      bool splice_file(Session& session);
+      // Queues a poll for room on the socket, linked to the next request
+      void wait_writable(Session& session);
+      // Points sqe at the session's socket, by slot when it has one
+      void target(io_uring_sqe* sqe, const Session& session) const;
+      void shut(Session& session);
+      // Frees the session once nothing is in flight, true if it did
+      bool reap(Session& session);
+  };
+} // namespace swerver
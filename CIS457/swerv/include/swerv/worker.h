@@ -0,0 +1,29 @@
+#pragma once
+
+#include <ctime>
+
+namespace swerver {
+  // One worker loop, whatever it waits on. Every worker owns a SO_REUSEPORT
+  // listening socket and the kernel spreads new connections across them.
+  // Connections never move between workers, so nothing here is locked.
+  class Worker {
+    public:
+      virtual ~Worker() = default;
+
+      // False if the kernel won't give us what the loop needs
+      virtual bool init() = 0;
+
+      // Runs the loop until the server has drained
+      virtual void run() = 0;
+
+      // pthread entry point, args is the Worker
+      static void* start(void* args) {
+        static_cast<Worker*>(args)->run();
+        return nullptr;
+      }
+
+    protected:
+      // Seconds a draining worker waits on responses still going out
+      static const time_t DRAIN_TIMEOUT = 10;
+  };
+} // namespace swerver
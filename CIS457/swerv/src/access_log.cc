@@ -0,0 +1,165 @@
+#include <swerv/access_log.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace swerver {
+  // How long the writer sleeps between batches
+  static const auto DRAIN_INTERVAL = std::chrono::milliseconds(200);
+
+  AccessLog::AccessLog(std::string dir, size_t max_size, int keep)
+    : path(dir + "/access.log"), max_size(max_size), keep(keep) {}
+
+  AccessLog::~AccessLog() {
+    if (this->started) {
+      this->stopping.store(true, std::memory_order_release);
+      pthread_join(this->writer, nullptr);
+    }
+    if (this->fd >= 0) {
+      close(this->fd);
+    }
+  }
+
+  bool AccessLog::start() {
+    if (!open_file()) {
+      return false;
+    }
+
+    if (pthread_create(&this->writer, nullptr, AccessLog::serve, this) != 0) {
+      return false;
+    }
+    this->started = true;
+
+    return true;
+  }
+
+  AccessLog::Ring* AccessLog::ring() {
+    // Rings are never freed, so the pointer stays good for the thread's life
+    thread_local Ring* mine = nullptr;
+    if (mine == nullptr) {
+      std::lock_guard<std::mutex> guard(this->rings_lock);
+      this->rings.emplace_back(new Ring());
+      mine = this->rings.back().get();
+    }
+    return mine;
+  }
+
+  void AccessLog::write(const std::string& line) {
+    Ring* r = ring();
+
+    size_t head = r->head.load(std::memory_order_relaxed);
+    size_t tail = r->tail.load(std::memory_order_acquire);
+    if (Ring::SIZE - (head - tail) < line.size()) {
+      r->dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    size_t at = head % Ring::SIZE;
+    size_t first = std::min(line.size(), Ring::SIZE - at);
+    std::memcpy(r->data.get() + at, line.data(), first);
+    std::memcpy(r->data.get(), line.data() + first, line.size() - first);
+
+    r->head.store(head + line.size(), std::memory_order_release);
+  }
+
+  void AccessLog::drain(std::string& batch) {
+    std::lock_guard<std::mutex> guard(this->rings_lock);
+
+    for (auto& r : this->rings) {
+      size_t tail = r->tail.load(std::memory_order_relaxed);
+      size_t head = r->head.load(std::memory_order_acquire);
+
+      while (tail != head) {
+        size_t at = tail % Ring::SIZE;
+        size_t len = std::min(head - tail, Ring::SIZE - at);
+        batch.append(r->data.get() + at, len);
+        tail += len;
+      }
+      r->tail.store(tail, std::memory_order_release);
+
+      uint64_t dropped = r->dropped.exchange(0, std::memory_order_relaxed);
+      if (dropped > 0) {
+        batch += "# dropped " + std::to_string(dropped) + " lines\n";
+      }
+    }
+  }
+
+  void AccessLog::flush(const std::string& batch) {
+    size_t done = 0;
+    while (done < batch.size()) {
+      ssize_t n = ::write(this->fd, batch.data() + done, batch.size() - done);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        std::cerr << "Failed to write " << this->path << ": " << std::strerror(errno) << std::endl;
+        return;
+      }
+      done += n;
+    }
+
+    this->size += batch.size();
+    if (this->size >= this->max_size) {
+      rotate();
+    }
+  }
+
+  bool AccessLog::open_file() {
+    this->fd = open(this->path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (this->fd < 0) {
+      return false;
+    }
+
+    struct stat info;
+    this->size = fstat(this->fd, &info) == 0 ? info.st_size : 0;
+    return true;
+  }
+
+  void AccessLog::rotate() {
+    // The oldest falls off the end and everything else moves up one
+    for (int i = this->keep - 1; i > 0; --i) {
+      std::string from = this->path + "." + std::to_string(i);
+      std::string to = this->path + "." + std::to_string(i + 1);
+      std::rename(from.c_str(), to.c_str());
+    }
+    if (this->keep > 0) {
+      std::rename(this->path.c_str(), (this->path + ".1").c_str());
+    } else {
+      unlink(this->path.c_str());
+    }
+
+    close(this->fd);
+    if (!open_file()) {
+      std::cerr << "Failed to reopen " << this->path << ", access log stops" << std::endl;
+    }
+  }
+
+  void* AccessLog::serve(void* args) {
+    AccessLog* log = static_cast<AccessLog*>(args);
+    std::string batch;
+
+    while (log->fd >= 0) {
+      // Read before draining, so a line queued before the destructor ran
+      // is always in the last batch
+      bool last = log->stopping.load(std::memory_order_acquire);
+
+      batch.clear();
+      log->drain(batch);
+      if (!batch.empty()) {
+        log->flush(batch);
+      }
+      if (last) break;
+
+      std::this_thread::sleep_for(DRAIN_INTERVAL);
+    }
+
+    return nullptr;
+  }
+} // namespace swerver
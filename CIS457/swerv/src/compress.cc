@@ -0,0 +1,25 @@
+#include <swerv/compress.h>
+
+#include <zlib.h>
+
+namespace swerver {
+  bool gzip(const std::string& in, std::string& out) {
+    z_stream stream = {};
+    // 16 on top of the window bits asks for a gzip wrapper instead of zlib's
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+    }
+
+    out.resize(deflateBound(&stream, in.size()));
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    stream.avail_in = in.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    stream.avail_out = out.size();
+
+    int result = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    return result == Z_STREAM_END;
+  }
+} // namespace swerver
@@ -0,0 +1,206 @@
+#include <swerv/connection.h>
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <utility>
+
+namespace swerver {
+  // Seconds a keep-alive connection may sit between requests
+  static const time_t IDLE_TIMEOUT = 15;
+  // Seconds to get a whole request head in, and then its body
+  static const time_t HEAD_TIMEOUT = 10;
+  static const time_t BODY_TIMEOUT = 30;
+  // Seconds a response may go without the client taking any of it
+  static const time_t SEND_TIMEOUT = 30;
+
+  // Queued response past which we stop reading requests: pieces in all,
+  // pieces holding a file or stream open, and bytes in memory
+  static const size_t MAX_QUEUED_SEGMENTS = 256;
+  static const size_t MAX_QUEUED_OPEN = 16;
+  static const size_t MAX_QUEUED_BYTES = 1024 * 1024;
+
+  Segment::~Segment() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  Segment::Segment(Segment&& other) noexcept
+    : data(std::move(other.data)), stream(std::move(other.stream)), chunked(other.chunked),
+      owner(std::move(other.owner)), shared(other.shared),
+      shared_length(other.shared_length), fd(other.fd), offset(other.offset), length(other.length) {
+    other.fd = -1;
+  }
+
+  Segment& Segment::operator=(Segment&& other) noexcept {
+    if (this != &other) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      data = std::move(other.data);
+      stream = std::move(other.stream);
+      chunked = other.chunked;
+      owner = std::move(other.owner);
+      shared = other.shared;
+      shared_length = other.shared_length;
+      fd = other.fd;
+      offset = other.offset;
+      length = other.length;
+      other.fd = -1;
+    }
+    return *this;
+  }
+
+  void Segment::next_chunk() {
+    // Bounds what a streamed response holds at any moment
+    static const size_t CHUNK = 16 * 1024;
+
+    data.clear();
+    if (!chunked) {
+      if (!stream->read(data, CHUNK)) {
+        stream.reset();
+      }
+      return;
+    }
+
+    // Room for the size line up front, filled in once we know the size
+    static const size_t SIZE_LINE = 10;
+    data.assign(SIZE_LINE, ' ');
+    bool more = stream->read(data, CHUNK);
+
+    size_t length = data.size() - SIZE_LINE;
+    if (length == 0) {
+      data.clear();
+    } else {
+      char line[SIZE_LINE + 1];
+      int n = std::snprintf(line, sizeof(line), "%zx\r\n", length);
+      data.replace(0, SIZE_LINE, line, n);
+      data += "\r\n";
+    }
+
+    if (!more) {
+      data += "0\r\n\r\n";
+      stream.reset();
+    }
+  }
+
+  void Connection::write(const std::string& data) {
+    if (data.empty()) return;
+
+    if (out.empty() || out.back().is_file() || out.back().is_shared() || out.back().is_stream()) {
+      out.emplace_back();
+    }
+    out.back().data += data;
+  }
+
+  void Connection::write_shared(std::shared_ptr<const void> owner, const char* data, size_t length) {
+    if (length == 0) return;
+
+    out.emplace_back();
+    Segment& segment = out.back();
+    segment.owner = std::move(owner);
+    segment.shared = data;
+    segment.shared_length = length;
+  }
+
+  void Connection::write_stream(std::unique_ptr<Stream> stream, bool chunked) {
+    out.emplace_back();
+    Segment& segment = out.back();
+    segment.stream = std::move(stream);
+    segment.chunked = chunked;
+  }
+
+  void Connection::write_file(int fd, off_t offset, size_t length) {
+    if (length == 0) {
+      close(fd);
+      return;
+    }
+
+    out.emplace_back();
+    Segment& segment = out.back();
+    segment.fd = fd;
+    segment.offset = offset;
+    segment.length = length;
+  }
+
+  bool Connection::advance_stream() {
+    Segment& front = out.front();
+    if (!front.is_stream() || data_offset < front.data.size()) return false;
+
+    // The last chunk is out, time for the next one
+    data_offset = 0;
+    front.next_chunk();
+    if (front.data.empty() && !front.is_stream()) {
+      out.pop_front();
+    }
+    return true;
+  }
+
+  int Connection::gather(iovec* iov, int max) const {
+    const Segment& front = out.front();
+    int count = 0;
+    for (auto it = out.begin(); it != out.end() && count < max && !it->is_file()
+        && (count == 0 || !it->is_stream()) && !(count == 1 && front.is_stream()); ++it) {
+      std::string_view bytes = it->bytes();
+      size_t skip = count == 0 ? data_offset : 0;
+      iov[count].iov_base = const_cast<char*>(bytes.data() + skip);
+      iov[count].iov_len = bytes.size() - skip;
+      ++count;
+    }
+    return count;
+  }
+
+  bool Connection::backed_up() const {
+    if (out.size() >= MAX_QUEUED_SEGMENTS) return true;
+
+    size_t open = 0;
+    size_t bytes = 0;
+    for (const Segment& segment : out) {
+      if (segment.is_file() || segment.is_stream()) {
+        ++open;
+      }
+      bytes += segment.bytes().size();
+      if (open >= MAX_QUEUED_OPEN || bytes >= MAX_QUEUED_BYTES) return true;
+    }
+    return false;
+  }
+
+  void Connection::update_deadline(time_t now, bool writing) {
+    Wait next = writing ? waiting_send
+      : parser.in_body() ? waiting_body
+      : !in.empty() ? waiting_head
+      : waiting_idle;
+    if (deadline != 0 && next == wait && !(next == waiting_send && wrote)) return;
+
+    static const time_t timeouts[] = { IDLE_TIMEOUT, HEAD_TIMEOUT, BODY_TIMEOUT, SEND_TIMEOUT };
+    wait = next;
+    deadline = now + timeouts[next];
+    wrote = false;
+  }
+
+  void Connection::consume(size_t sent) {
+    wrote = true;
+    while (sent > 0) {
+      size_t rest = out.front().bytes().size() - data_offset;
+      if (sent < rest || out.front().is_stream()) {
+        data_offset += sent;
+        return;
+      }
+      sent -= rest;
+      out.pop_front();
+      data_offset = 0;
+    }
+  }
+
+  std::string peer_name(const sockaddr_storage& addr) {
+    char peer[INET6_ADDRSTRLEN] = "-";
+    if (addr.ss_family == AF_INET) {
+      inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in*>(&addr)->sin_addr, peer, sizeof(peer));
+    } else if (addr.ss_family == AF_INET6) {
+      inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6*>(&addr)->sin6_addr, peer, sizeof(peer));
+    }
+    return peer;
+  }
+} // namespace swerver
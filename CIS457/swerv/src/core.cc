@@ -1,55 +1,91 @@
 #include <swerv/core.h>
 
-#include <boost/algorithm/string.hpp>
+#include <swerv/compress.h>
+#include <swerv/directory_listing.h>
+#include <swerv/reactor.h>
+#include <swerv/uring_reactor.h>
+
+#include <algorithm>
 #include <chrono>
+#include <cerrno>
+#include <csignal>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
 #include <filesystem>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <sstream>
+#include <thread>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <vector>
 
 namespace swerver {
-  Core::ContentType Core::make_content_type(std::string ext) {
-    if (ext == "html") {
-      return Core::ContentType::html;
-    } else if (ext == "txt") {
-      return Core::ContentType::text;
-    } else if (ext == "jpg") {
-      return Core::ContentType::jpeg;
-    } else if (ext == "pdf") {
-      return Core::ContentType::pdf;
-    } else {
-      return Core::ContentType::html;
-    }
-  }
+  // More ranges than this in one request and we send the whole file
+  static const size_t MAX_RANGES = 16;
 
-  void Core::log_request(std::string log) {
-    std::cout << log << std::endl;
-  }
+  // Below this gzip's own header eats most of what it saves
+  static const size_t MIN_GZIP_SIZE = 256;
 
-  std::string Core::make_path(std::string dir, std::string file) const {
-    std::filesystem::path p = std::filesystem::current_path();
+  // Accept-Encoding bits
+  static const int ENCODING_GZIP = 1;
+  static const int ENCODING_BR = 2;
+
+  // Files bigger than this always go out with sendfile
+  static const size_t CACHE_MAX_ENTRY = 256 * 1024;
+
+  // The access log rotates at this size and keeps this many old files
+  static const size_t LOG_MAX_SIZE = 64 << 20;
+  static const int LOG_KEEP = 4;
 
-    return std::string(p);
+  // Set from the signal handler, read by every worker on its tick
+  static std::atomic<bool> stopping{false};
+
+  static void on_stop(int) {
+    stopping.store(true, std::memory_order_relaxed);
   }
 
-  std::string Core::read_file(std::string filename) const {
-    std::ifstream f(filename);
-    if (!f.good()) return "";
+  void Core::log_request(const Connection& conn, const Request& request) {
+    if (!this->access_log) return;
+
+    // Formatting the time is the slow part and it only changes once a second
+    thread_local time_t stamp_second = 0;
+    thread_local char stamp[64];
+    time_t now = std::time(nullptr);
+    if (now != stamp_second) {
+      std::tm tm;
+      localtime_r(&now, &tm);
+      std::strftime(stamp, sizeof(stamp), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+      stamp_second = now;
+    }
+
+    std::string_view request_line = request.head.substr(0, request.head.find_first_of("\r\n"));
 
-    // Write to a string
-    std::string str((std::istreambuf_iterator<char>(f)),
-                     std::istreambuf_iterator<char>());
+    // host ident authuser [date] "request" status bytes
+    std::string line;
+    line.reserve(128 + request_line.size());
+    line += conn.peer;
+    line += " - - ";
+    line += stamp;
+    line += " \"";
+    line += request_line;
+    line += "\" ";
+    line += std::to_string(conn.status);
+    line += ' ';
+    line += conn.body_bytes > 0 ? std::to_string(conn.body_bytes) : "-";
+    line += '\n';
 
-    return str;
+    this->access_log->write(line);
+  }
+
+  std::string Core::make_path(std::string dir, std::string file) const {
+    return dir + "/" + file;
   }
 
   void Core::usage() const {
@@ -58,18 +94,33 @@ namespace swerver {
       " swerver -p <PORT>       Specifies which port to run on.\n"
       " swerver -docroot <DIR>  Specifies where the docroot will be.\n"
       " swerver -logfile <FILE> Specifies where log files will be written to.\n"
+      " swerver -workers <N>    Number of worker loops, defaults to one per core.\n"
+      " swerver -engine <NAME>  Worker loop, epoll (default) or uring.\n"
+      " swerver -maxconn <N>    Open connections allowed across all workers.\n"
+      " swerver -cache <MB>     Memory for caching small files, 0 turns it off.\n"
+      " swerver -mime <FILE>    Extra MIME types in mime.types format.\n"
       " swerver default         Run server with default settings.\n";
 
     std::cout << help << std::endl;
   }
 
-  std::string Core::check_file_mod(std::string path) {
-    auto time = std::filesystem::last_write_time(path);
-    auto cftime = decltype(time)::clock::to_time_t(time);
-    auto final_time = std::asctime(std::localtime(&cftime));
+  std::string Core::http_date(time_t t) {
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    char final_time[64];
+    std::strftime(final_time, sizeof(final_time), "%a, %d %b %Y %H:%M:%S GMT", &tm);
     return std::string(final_time);
   }
 
+  std::string Core::make_etag(const struct stat& info) {
+    // Inode, size and mtime down to the nanosecond, so a file replaced by
+    // one of the same size in the same second still gets a new tag
+    std::ostringstream etag;
+    etag << std::hex << '"' << info.st_ino << '-' << info.st_size << '-'
+      << info.st_mtim.tv_sec << '.' << info.st_mtim.tv_nsec << '"';
+    return etag.str();
+  }
+
   std::string Core::get_current_time() {
     auto now = std::chrono::system_clock::now();
     auto in_time_t = std::chrono::system_clock::to_time_t(now);
@@ -80,24 +131,54 @@ namespace swerver {
     return time.str();
   }
 
-  std::string Core::modded_since(std::string req, std::string filename, std::string ext) {
-    if (ext == "html" || ext == "txt") {
-      std::string mod_header;
-      // Need to double check this
-      mod_header = req.substr(0, 19);
+  bool Core::modded_since(const Request& request, const std::string& etag, time_t mtime) const {
+    // If-None-Match wins when both are sent. GET compares weakly, so a W/
+    // on either side doesn't matter.
+    std::string_view if_none_match = request.header("If-None-Match");
+    if (!if_none_match.empty()) {
+      std::string_view ours = etag;
+      if (ours.substr(0, 2) == "W/") ours.remove_prefix(2);
 
-      if (mod_header == "If-Modified-Since:") {
-        std::string date_mod_since = req.substr(19, 29);
-        std::string file_mod = check_file_mod(filename);
+      while (!if_none_match.empty()) {
+        size_t comma = if_none_match.find(',');
+        std::string_view tag = if_none_match.substr(0, comma);
+        if_none_match = comma == std::string_view::npos ? std::string_view() : if_none_match.substr(comma + 1);
 
-        if (date_mod_since == file_mod) {
-          return file_mod;
-        }
-        return file_mod;
+        while (!tag.empty() && (tag.front() == ' ' || tag.front() == '\t')) tag.remove_prefix(1);
+        while (!tag.empty() && (tag.back() == ' ' || tag.back() == '\t')) tag.remove_suffix(1);
+        if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+
+        if (tag == "*" || tag == ours) return false;
       }
+      return true;
     }
 
-    return "";
+    std::string_view if_modified_since = request.header("If-Modified-Since");
+    if (!if_modified_since.empty()) {
+      time_t since = parse_http_date(if_modified_since);
+      return since < 0 || mtime > since;
+    }
+
+    return true;
+  }
+
+  time_t Core::parse_http_date(std::string_view date) {
+    // IMF-fixdate, then the two obsolete forms clients are still allowed
+    static const char* formats[] = {
+      "%a, %d %b %Y %H:%M:%S GMT",
+      "%A, %d-%b-%y %H:%M:%S GMT",
+      "%a %b %e %H:%M:%S %Y"
+    };
+
+    std::string copy(date);
+    for (const char* format : formats) {
+      std::tm tm = {};
+      const char* end = strptime(copy.c_str(), format, &tm);
+      if (end != nullptr && *end == '\0') {
+        return timegm(&tm);
+      }
+    }
+    return -1;
   }
 
   bool Core::handle_args(int argc, char** argv) {
@@ -110,7 +191,7 @@ namespace swerver {
       std::cout << "Running server with default configuration" << std::endl;
       return true;
     } else {
-      for (int i = 1; i < argc - 1; ++i) {
+      for (int i = 1; i < argc - 1; i += 2) {
         std::string opt(argv[i]);
         if (opt == "-p") {
            this->port = std::stoi(argv[i + 1]);
@@ -118,6 +199,23 @@ namespace swerver {
            this->docroot = std::string(argv[i + 1]);
         } else if (opt == "-logfile") {
            this->logfile = std::string(argv[i + 1]);
+        } else if (opt == "-workers") {
+           this->workers = std::stoi(argv[i + 1]);
+        } else if (opt == "-engine") {
+           this->engine = std::string(argv[i + 1]);
+           if (this->engine != "epoll" && this->engine != "uring") {
+             std::cerr << "Unknown engine " << this->engine << ", use epoll or uring" << std::endl;
+             return false;
+           }
+        } else if (opt == "-maxconn") {
+           this->max_connections = std::stoi(argv[i + 1]);
+        } else if (opt == "-cache") {
+           this->cache_mb = std::stoi(argv[i + 1]);
+        } else if (opt == "-mime") {
+           if (!this->mime_types.load(argv[i + 1])) {
+             std::cerr << "Failed to read MIME types from " << argv[i + 1] << std::endl;
+             return false;
+           }
         } else {
            std::cerr << "Error, argument not supported" << std::endl;
            return false;
@@ -129,93 +227,191 @@ namespace swerver {
   }
 
   void Core::send_http_response(
-      int socket,
+      Connection& conn,
       int code,
       bool keep_alive,
-      Core::ContentType content_type,
+      std::string_view content_type,
       std::string filename,
       std::string last_modified,
       std::string file_data
       ) const {
-    std::string code_msg, connection_type, content_type_string, pdf_header;
-    auto now = std::chrono::system_clock::now();
-    auto in_time_t = std::chrono::system_clock::to_time_t(now);
-    std::string html = "";
+    // Our own pages live as long as we do, so they go out without a copy
+    const std::string* html = nullptr;
 
     switch (code) {
       case 200:
-        code_msg = "200 OK\r\n";
-        html = file_data;
+        html = &file_data;
         break;
-      case 304:
-        code_msg = "304 Not Modified\r\n";
-        html = file_data;
+      case 403:
+        html = &this->html403;
         break;
       case 404:
-        code_msg = "404 Not Found\r\n";
-        html = this->html404;
+        html = &this->html404;
+        break;
+      case 500:
+        html = &this->html500;
         break;
       case 501:
-        code_msg = "501 Not Implemented\r\n";
-        html = this->html501;
+        html = &this->html501;
         break;
       default:
-        code_msg = std::to_string(code) + "\r\n";
         break;
     }
 
-    if (keep_alive) {
-      connection_type = "keep-alive\r\n";
-    } else {
-      connection_type = "close\r\n";
+    size_t length = html ? html->length() : 0;
+    conn.write(this->make_header(code, keep_alive, content_type, filename, last_modified, "", length));
+    if (html == &file_data) {
+      conn.write(file_data);
+    } else if (html) {
+      conn.write_shared(nullptr, html->data(), length);
+    }
+    conn.status = code;
+    conn.body_bytes = length;
+  }
+
+  void Core::send_file_response(
+      Connection& conn,
+      bool keep_alive,
+      std::string_view content_type,
+      std::string filename,
+      std::string last_modified,
+      std::string etag,
+      std::string encoding,
+      int fd,
+      size_t size
+      ) const {
+    std::string header = this->make_status(200, keep_alive);
+    header += this->make_entity_headers(content_type, filename, last_modified, etag, encoding, size);
+    header += "\r\n";
+    conn.write(header);
+    conn.write_file(fd, 0, size);
+    conn.status = 200;
+    conn.body_bytes = size;
+  }
+
+  std::string Core::make_header(
+      int code,
+      bool keep_alive,
+      std::string_view content_type,
+      std::string filename,
+      std::string last_modified,
+      std::string etag,
+      size_t content_length
+      ) const {
+    std::string header = this->make_status(code, keep_alive);
+    header += this->make_entity_headers(content_type, filename, last_modified, etag, "", content_length);
+    header += "\r\n";
+    return header;
+  }
+
+  const std::string& Core::date_header() {
+    // Only changes once a second, so each worker formats it once a second
+    thread_local time_t second = 0;
+    thread_local std::string header;
+
+    time_t now = std::time(nullptr);
+    if (now != second) {
+      header = "Date: " + http_date(now) + "\r\n";
+      second = now;
     }
+    return header;
+  }
+
+  std::string Core::make_status(int code, bool keep_alive) const {
+    static const std::string status_200 = "HTTP/1.1 200 OK\r\n";
+    static const std::string status_206 = "HTTP/1.1 206 Partial Content\r\n";
+    static const std::string status_304 = "HTTP/1.1 304 Not Modified\r\n";
+    static const std::string status_400 = "HTTP/1.1 400 Bad Request\r\n";
+    static const std::string status_403 = "HTTP/1.1 403 Forbidden\r\n";
+    static const std::string status_404 = "HTTP/1.1 404 Not Found\r\n";
+    static const std::string status_416 = "HTTP/1.1 416 Range Not Satisfiable\r\n";
+    static const std::string status_500 = "HTTP/1.1 500 Internal Server Error\r\n";
+    static const std::string status_501 = "HTTP/1.1 501 Not Implemented\r\n";
+    static const std::string fixed = "Server: GVSU\r\nAccept-Ranges: bytes\r\n";
+    static const std::string keep_alive_header = "Connection: keep-alive\r\n";
+    static const std::string close_header = "Connection: close\r\n";
 
-    switch (content_type) {
-      case Core::ContentType::text:
-        // Text
-        content_type_string = "text/plain\r\n";
+    std::string header;
+    header.reserve(256);
+
+    switch (code) {
+      case 200:
+        header += status_200;
+        break;
+      case 206:
+        header += status_206;
+        break;
+      case 304:
+        header += status_304;
+        break;
+      case 400:
+        header += status_400;
+        break;
+      case 403:
+        header += status_403;
+        break;
+      case 404:
+        header += status_404;
+        break;
+      case 416:
+        header += status_416;
         break;
-      case Core::ContentType::html:
-        // html
-        content_type_string = "text/html\r\n";
+      case 500:
+        header += status_500;
         break;
-      case Core::ContentType::jpeg:
-        // jpeg
-        content_type_string = "image/jpeg\r\n";
+      case 501:
+        header += status_501;
         break;
-      case Core::ContentType::pdf:
-        // pdf
-        content_type_string = "application/pdf\r\n";
-        pdf_header = "Content-Disposition: inline; filename=" + filename + "\r\n";
+      default:
+        header += "HTTP/1.1 " + std::to_string(code) + "\r\n";
         break;
     }
 
-    std::ostringstream header;
-    header << "HTTP/1.1 " << code_msg
-      << "Date: " << std::put_time(std::localtime(&in_time_t), "%Y-%m-%d-%X")
-      << "\r\n"
-      << "Server: GVSU\r\n"
-      << "Accepted-Ranges: bytes\r\n"
-      << "Connection: "
-      << connection_type
-      << "Content-Type: "
-      << content_type_string
-      << "\r\n"
-      << "Content-Length: "
-      << html.length()
-      << "\r\n";
-    if (content_type == Core::ContentType::pdf) {
-      header << pdf_header;
+    header += date_header();
+    header += fixed;
+    header += keep_alive ? keep_alive_header : close_header;
+
+    return header;
+  }
+
+  std::string Core::make_entity_headers(
+      std::string_view content_type,
+      std::string filename,
+      std::string last_modified,
+      std::string etag,
+      std::string encoding,
+      size_t content_length
+      ) const {
+    std::string header;
+    header.reserve(192 + filename.size());
+
+    header += "Content-Type: ";
+    header += content_type;
+    header += "\r\n";
+
+    header += "Content-Length: ";
+    header += std::to_string(content_length);
+    header += "\r\n";
+
+    if (content_type == "application/pdf") {
+      header += "Content-Disposition: inline; filename=" + filename + "\r\n";
     }
 
     if (last_modified != "") {
-      header << "Last-Modified: "
-        << last_modified
-        << "\r\n\n";
+      header += "Last-Modified: " + last_modified + "\r\n";
+    }
+
+    if (etag != "") {
+      header += "ETag: " + etag + "\r\n";
+      // Any file might have a compressed sibling
+      header += "Vary: Accept-Encoding\r\n";
     }
 
-    send(socket, header.str().c_str(), header.str().size(), 0);
-    std::cout << "{ Header: " << header.str() << "}" << std::endl;
+    if (encoding != "") {
+      header += "Content-Encoding: " + encoding + "\r\n";
+    }
+
+    return header;
   }
 
   bool Core::init_system_file(std::string path, std::string default_path) {
@@ -248,52 +444,551 @@ namespace swerver {
     return true;
   }
 
-  void* Core::thread_handler(void* args) {
-    Core::thread t;
-    Core c;
-    std::memcpy(&t, args, sizeof(Core::thread));
-    socklen_t sin_size = sizeof t.socket;
-    char line[5000];
+  bool Core::admit() {
+    if (this->open_connections.fetch_add(1, std::memory_order_relaxed) >= this->max_connections) {
+      this->open_connections.fetch_sub(1, std::memory_order_relaxed);
+      return false;
+    }
+    return true;
+  }
+
+  void Core::release() {
+    this->open_connections.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool Core::has_room() const {
+    return this->open_connections.load(std::memory_order_relaxed) < this->max_connections;
+  }
+
+  bool Core::draining() {
+    return stopping.load(std::memory_order_relaxed);
+  }
+
+  void Core::handle_requests(Connection& conn) {
+    // Requests are parsed in place and only dropped from the buffer once
+    // the whole batch is answered
+    size_t start = 0;
+    conn.paused = false;
 
     for (;;) {
-      int in = recv(t.socket, line, 5000, 0);
-      if (in < 0) {
-        std::cout << "Failed to get data from client" << std::endl;
+      start += conn.parser.skip_body(conn.in.size() - start);
+      if (conn.parser.in_body()) break;
+
+      if (conn.backed_up()) {
+        conn.paused = true;
+        break;
       }
 
-      std::string input(line);
+      RequestParser::Status status = conn.parser.parse(conn.in, start);
+      if (status == RequestParser::incomplete) break;
 
-      c.log_request(input);
+      if (status == RequestParser::bad) {
+        this->send_http_response(conn, 400, false, "text/html", "", "", "");
+        conn.closing = true;
+        break;
+      }
+
+      const Request& request = conn.parser.request();
 
-      std::string request_type = input.substr(0, 3);
+      if (request.method == "GET") {
+        this->handle_get(request, conn);
+      } else {
+        this->send_http_response(conn, 501, request.keep_alive, "text/html", "", "", "");
+      }
+      this->log_request(conn, request);
 
-      if (request_type == "GET") {
-        bool file_request = false;
-        std::string req = input.substr(5, input.substr(5).find(" ", 0));
+      start += conn.parser.consumed();
+      conn.parser.reset();
 
-        if (req == "") {
-          c.send_http_response(t.socket, 200, true, c.Core::ContentType::html, "", "", c.html200Default);
-        } else {
-          std::vector<std::string> filename;
-          auto content_type = c.make_content_type(filename[1]);
-          boost::algorithm::split(filename, req, boost::is_any_of("."));
-
-          // Check if the file exists first
-          if (access(req.c_str(), F_OK) != -1) {
-            std::string did_mod = c.modded_since(input, req, filename[1]);
-            if (did_mod != "") {
-              auto file_contents = c.read_file(req);
-              if (file_contents == "") c.send_http_response(t.socket, 200, true, c.Core::ContentType::html, "", "", c.html200Failed);
-              c.send_http_response(t.socket, 200, true, content_type, req, did_mod, file_contents);
-            } else {
-              auto file_contents = c.read_file(req);
-              if (file_contents == "") c.send_http_response(t.socket, 200, true, c.Core::ContentType::html, "", "", c.html200Failed);
-              c.send_http_response(t.socket, 304, true, content_type, req, did_mod, file_contents);
-            }
+      if (!request.keep_alive || conn.closing) {
+        conn.closing = true;
+        break;
+      }
+    }
+
+    // Requests held back stay put until out drains
+    if (conn.closing && !conn.paused) {
+      conn.in.clear();
+      conn.parser.reset();
+    } else {
+      conn.in.erase(0, start);
+      conn.parser.shift(start);
+    }
+  }
+
+  void Core::handle_get(const Request& request, Connection& conn) {
+    bool keep_alive = request.keep_alive;
+
+    // Paths are relative to the docroot and the query string is ignored
+    std::string_view target = request.target.substr(0, request.target.find('?'));
+    if (target.empty() || target.front() != '/') {
+      this->send_http_response(conn, 400, keep_alive, "text/html", "", "", "");
+      return;
+    }
+    std::string req;
+    if (!percent_decode(target.substr(1), req)) {
+      this->send_http_response(conn, 400, keep_alive, "text/html", "", "", "");
+      return;
+    }
+
+    if (req == "") {
+      this->send_http_response(conn, 200, keep_alive, "text/html", "", "", this->html200Default);
+      return;
+    }
+
+    // Nothing outside the docroot gets served
+    if (req.find("..") != std::string::npos) {
+      this->send_http_response(conn, 404, keep_alive, "text/html", "", "", "");
+      return;
+    }
+
+    std::string path = this->make_path(this->docroot, req);
+
+    // What we hand this client depends on what it can decode, so each set
+    // of encodings it might take is cached separately
+    int encodings = accepted_encodings(request);
+    std::string variant = (encodings & ENCODING_BR) && (encodings & ENCODING_GZIP) ? "br,gzip"
+      : encodings & ENCODING_BR ? "br" : encodings & ENCODING_GZIP ? "gzip" : "";
+    if (this->cache) {
+      auto cached = this->cache->find(FileCache::key(path, variant));
+      // Never hand out an encoding the client didn't ask for
+      if (cached && (cached->encoding.empty()
+            || (cached->encoding == "br" && (encodings & ENCODING_BR))
+            || (cached->encoding == "gzip" && (encodings & ENCODING_GZIP)))) {
+        this->serve_cached(request, conn, std::move(cached));
+        return;
+      }
+    }
+    // Taken before the file is opened, see FileCache::insert
+    uint64_t generation = this->cache ? this->cache->generation() : 0;
+
+    // A precompressed sibling beats compressing it ourselves
+    int fd = -1;
+    std::string encoding;
+    std::string opened;
+    struct stat info;
+    if (encodings & ENCODING_BR) {
+      opened = path + ".br";
+      fd = open_regular(opened, info);
+      if (fd >= 0) encoding = "br";
+    }
+    if (fd < 0 && encodings & ENCODING_GZIP) {
+      opened = path + ".gz";
+      fd = open_regular(opened, info);
+      if (fd >= 0) encoding = "gzip";
+    }
+
+    if (fd < 0) {
+      opened = path;
+      fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        // An error page must not go out as a 200 that caches keep
+        int code = errno == ENOENT || errno == ENOTDIR ? 404 : errno == EACCES ? 403 : 500;
+        this->send_http_response(conn, code, keep_alive, "text/html", "", "", "");
+        return;
+      }
+
+      if (fstat(fd, &info) == 0 && S_ISDIR(info.st_mode)) {
+        this->send_directory(request, conn, fd, req);
+        return;
+      }
+
+      // The length comes from the descriptor we send from, so a file swapped
+      // after the open can't make the header disagree with the body
+      if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        this->send_http_response(conn, 404, keep_alive, "text/html", "", "", "");
+        return;
+      }
+    }
+
+    std::string_view content_type = this->mime_types.lookup(req);
+    std::string last_modified = http_date(info.st_mtime);
+    std::string etag = make_etag(info);
+
+    if (this->cache && this->cache->cacheable(opened, info)) {
+      auto file = std::make_shared<CachedFile>();
+      if (read_all(fd, info.st_size, file->body)) {
+        close(fd);
+
+        // Text is compressed once here and then served from the cache
+        std::string compressed;
+        if (encoding.empty() && encodings & ENCODING_GZIP
+            && MimeTypes::compressible(content_type)
+            && file->body.size() >= MIN_GZIP_SIZE
+            && gzip(file->body, compressed) && compressed.size() < file->body.size()) {
+          file->body.swap(compressed);
+          encoding = "gzip";
+          etag.insert(etag.size() - 1, "-gzip");
+        }
+
+        file->content_type = std::string(content_type);
+        file->mtime = info.st_mtime;
+        file->etag = etag;
+        file->last_modified = last_modified;
+        file->encoding = encoding;
+        file->headers = this->make_entity_headers(content_type, req, last_modified, etag, encoding, file->body.size());
+        this->serve_cached(request, conn, file);
+        this->cache->insert(FileCache::key(path, variant), std::move(file), generation);
+        return;
+      }
+    }
+
+    if (!this->modded_since(request, etag, info.st_mtime)) {
+      close(fd);
+      this->send_not_modified(conn, keep_alive, etag, last_modified);
+      return;
+    }
+
+    std::vector<ByteRange> ranges;
+    int code = this->select_ranges(request, info.st_size, etag, last_modified, ranges);
+    if (code == 200) {
+      this->send_file_response(conn, keep_alive, content_type, req, last_modified, etag, encoding, fd, info.st_size);
+      return;
+    }
+
+    // Every part gets its own descriptor since segments own theirs
+    this->send_ranges(conn, keep_alive, code, content_type, info.st_size, last_modified, etag, encoding, ranges,
+        [&conn, fd](size_t offset, size_t length) {
+          int part = dup(fd);
+          if (part < 0) {
+            conn.closing = true;
+            return;
           }
+          conn.write_file(part, offset, length);
+        });
+    close(fd);
+  }
+
+  void Core::send_directory(const Request& request, Connection& conn, int fd, std::string req) const {
+    DIR* dir = fdopendir(fd);
+    if (dir == nullptr) {
+      close(fd);
+      this->send_http_response(conn, 404, request.keep_alive, "text/html", "", "", "");
+      return;
+    }
+
+    if (req.empty() || req.back() != '/') req += '/';
+    std::unique_ptr<Stream> listing(new DirectoryListing(dir, "/" + req));
+    this->send_stream_response(request, conn, 200, "text/html", std::move(listing));
+  }
+
+  void Core::send_stream_response(
+      const Request& request,
+      Connection& conn,
+      int code,
+      std::string_view content_type,
+      std::unique_ptr<Stream> body) const {
+    // HTTP/1.0 can't do chunked, it gets the body up to the close instead
+    bool chunked = request.version != "HTTP/1.0";
+    bool keep_alive = request.keep_alive && chunked;
+
+    std::string header = this->make_status(code, keep_alive);
+    header += "Content-Type: ";
+    header += content_type;
+    header += "\r\n";
+    if (chunked) {
+      header += "Transfer-Encoding: chunked\r\n";
+    }
+    header += "\r\n";
+
+    conn.write(header);
+    conn.write_stream(std::move(body), chunked);
+    conn.status = code;
+    conn.body_bytes = 0;
+    if (!keep_alive) {
+      conn.closing = true;
+    }
+  }
+
+  bool Core::percent_decode(std::string_view in, std::string& out) {
+    auto digit = [](char c) {
+      if (c >= '0' && c <= '9') return c - '0';
+      if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+      if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+      return -1;
+    };
+
+    out.clear();
+    out.reserve(in.size());
+    for (size_t i = 0; i < in.size(); ++i) {
+      if (in[i] != '%') {
+        out += in[i];
+        continue;
+      }
+      if (i + 2 >= in.size()) return false;
+      int high = digit(in[i + 1]);
+      int low = digit(in[i + 2]);
+      // A NUL would cut the path short when it reaches open
+      if (high < 0 || low < 0 || (high == 0 && low == 0)) return false;
+      out += static_cast<char>(high << 4 | low);
+      i += 2;
+    }
+    return true;
+  }
+
+  int Core::open_regular(const std::string& path, struct stat& info) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  int Core::accepted_encodings(const Request& request) {
+    std::string_view accept = request.header("Accept-Encoding");
+    int encodings = 0;
+
+    while (!accept.empty()) {
+      size_t comma = accept.find(',');
+      std::string_view coding = accept.substr(0, comma);
+      accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+
+      // q=0 means anything but this one
+      size_t semicolon = coding.find(';');
+      std::string_view params = semicolon == std::string_view::npos ? std::string_view() : coding.substr(semicolon + 1);
+      coding = coding.substr(0, semicolon);
+      while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t')) coding.remove_prefix(1);
+      while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t')) coding.remove_suffix(1);
+
+      size_t q = params.find("q=");
+      if (q != std::string_view::npos) {
+        std::string_view value = params.substr(q + 2);
+        bool zero = true;
+        for (char c : value) {
+          if (c >= '1' && c <= '9') zero = false;
+          else if (c != '0' && c != '.') break;
         }
+        if (zero) continue;
+      }
+
+      if (coding == "br") encodings |= ENCODING_BR;
+      else if (coding == "gzip" || coding == "x-gzip") encodings |= ENCODING_GZIP;
+      else if (coding == "*") encodings |= ENCODING_BR | ENCODING_GZIP;
+    }
+
+    return encodings;
+  }
+
+  void Core::serve_cached(const Request& request, Connection& conn, std::shared_ptr<const CachedFile> file) const {
+    if (!this->modded_since(request, file->etag, file->mtime)) {
+      this->send_not_modified(conn, request.keep_alive, file->etag, file->last_modified);
+      return;
+    }
+
+    std::vector<ByteRange> ranges;
+    int code = this->select_ranges(request, file->body.size(), file->etag, file->last_modified, ranges);
+    if (code == 200) {
+      this->send_cached_response(conn, request.keep_alive, std::move(file));
+      return;
+    }
+
+    this->send_ranges(conn, request.keep_alive, code, file->content_type, file->body.size(),
+        file->last_modified, file->etag, file->encoding, ranges,
+        [&conn, &file](size_t offset, size_t length) {
+          conn.write_shared(file, file->body.data() + offset, length);
+        });
+  }
+
+  void Core::send_not_modified(
+      Connection& conn,
+      bool keep_alive,
+      const std::string& etag,
+      const std::string& last_modified) const {
+    // Just the validators, a 304 never has a body
+    std::string header = this->make_status(304, keep_alive);
+    header += "ETag: " + etag + "\r\n";
+    header += "Last-Modified: " + last_modified + "\r\n";
+    header += "Vary: Accept-Encoding\r\n";
+    header += "\r\n";
+    conn.write(header);
+    conn.status = 304;
+    conn.body_bytes = 0;
+  }
+
+  int Core::select_ranges(
+      const Request& request,
+      size_t size,
+      const std::string& etag,
+      const std::string& last_modified,
+      std::vector<ByteRange>& ranges) const {
+    std::string_view range = request.header("Range");
+    if (range.substr(0, 6) != "bytes=") return 200;
+
+    // A range of a version the client doesn't have is no use to it
+    std::string_view if_range = request.header("If-Range");
+    if (!if_range.empty() && if_range != etag && if_range != last_modified) return 200;
+
+    range.remove_prefix(6);
+    while (!range.empty()) {
+      size_t comma = range.find(',');
+      std::string_view spec = range.substr(0, comma);
+      range = comma == std::string_view::npos ? std::string_view() : range.substr(comma + 1);
+
+      while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) spec.remove_prefix(1);
+      while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) spec.remove_suffix(1);
+      if (spec.empty()) continue;
+
+      size_t dash = spec.find('-');
+      if (dash == std::string_view::npos) return 200;
+
+      size_t first = 0, last = 0;
+      bool has_first = false, has_last = false;
+      for (char c : spec.substr(0, dash)) {
+        if (c < '0' || c > '9' || first > (size_t(1) << 50)) return 200;
+        first = first * 10 + (c - '0');
+        has_first = true;
+      }
+      for (char c : spec.substr(dash + 1)) {
+        if (c < '0' || c > '9' || last > (size_t(1) << 50)) return 200;
+        last = last * 10 + (c - '0');
+        has_last = true;
+      }
+
+      if (!has_first) {
+        // -N is the last N bytes
+        if (!has_last) return 200;
+        if (last == 0 || size == 0) continue;
+        last = std::min(last, size);
+        ranges.emplace_back(size - last, last);
+      } else {
+        if (has_last && last < first) return 200;
+        if (first >= size) continue;
+        last = has_last ? std::min(last, size - 1) : size - 1;
+        ranges.emplace_back(first, last - first + 1);
+      }
+
+      // Lots of little ranges cost more than the whole file
+      if (ranges.size() > MAX_RANGES) {
+        ranges.clear();
+        return 200;
       }
     }
+
+    return ranges.empty() ? 416 : 206;
+  }
+
+  void Core::send_ranges(
+      Connection& conn,
+      bool keep_alive,
+      int code,
+      std::string_view content_type,
+      size_t size,
+      const std::string& last_modified,
+      const std::string& etag,
+      const std::string& encoding,
+      const std::vector<ByteRange>& ranges,
+      const std::function<void(size_t, size_t)>& body) const {
+    static const std::string boundary = "swerv0f3c9a7e52b1d684";
+
+    std::string header = this->make_status(code, keep_alive);
+    conn.status = code;
+    conn.body_bytes = 0;
+
+    if (code == 416) {
+      header += "Content-Range: bytes */" + std::to_string(size) + "\r\n";
+      header += "Content-Length: 0\r\n\r\n";
+      conn.write(header);
+      return;
+    }
+
+    auto content_range = [size](const ByteRange& range) {
+      return "Content-Range: bytes " + std::to_string(range.first) + "-"
+        + std::to_string(range.first + range.second - 1) + "/" + std::to_string(size) + "\r\n";
+    };
+
+    std::string validators;
+    if (last_modified != "") validators += "Last-Modified: " + last_modified + "\r\n";
+    if (etag != "") validators += "ETag: " + etag + "\r\nVary: Accept-Encoding\r\n";
+    if (encoding != "") validators += "Content-Encoding: " + encoding + "\r\n";
+
+    if (ranges.size() == 1) {
+      header += "Content-Type: " + std::string(content_type) + "\r\n";
+      header += "Content-Length: " + std::to_string(ranges[0].second) + "\r\n";
+      header += content_range(ranges[0]);
+      header += validators;
+      header += "\r\n";
+      conn.write(header);
+      body(ranges[0].first, ranges[0].second);
+      conn.body_bytes = ranges[0].second;
+      return;
+    }
+
+    // multipart/byteranges, the length has to be known up front
+    std::vector<std::string> parts;
+    size_t length = 0;
+    for (const auto& range : ranges) {
+      parts.push_back("\r\n--" + boundary + "\r\nContent-Type: " + std::string(content_type) + "\r\n"
+          + content_range(range) + "\r\n");
+      length += parts.back().size() + range.second;
+    }
+    const std::string closing = "\r\n--" + boundary + "--\r\n";
+    length += closing.size();
+
+    header += "Content-Type: multipart/byteranges; boundary=" + boundary + "\r\n";
+    header += "Content-Length: " + std::to_string(length) + "\r\n";
+    header += validators;
+    header += "\r\n";
+    conn.write(header);
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      conn.write(parts[i]);
+      body(ranges[i].first, ranges[i].second);
+    }
+    conn.write(closing);
+    conn.body_bytes = length;
+  }
+
+  void Core::send_cached_response(Connection& conn, bool keep_alive, std::shared_ptr<const CachedFile> file) const {
+    // The header is a few copies, the body is only referenced and goes out
+    // alongside it in the same writev
+    std::string header = this->make_status(200, keep_alive);
+    header += file->headers;
+    header += "\r\n";
+    conn.write(header);
+    conn.status = 200;
+    conn.body_bytes = file->body.size();
+    const std::string& body = file->body;
+    conn.write_shared(std::move(file), body.data(), body.size());
+  }
+
+  bool Core::read_all(int fd, size_t size, std::string& out) {
+    out.resize(size);
+    size_t got = 0;
+    while (got < size) {
+      ssize_t in = pread(fd, &out[got], size - got, got);
+      if (in < 0 && errno == EINTR) continue;
+      if (in <= 0) return false;
+      got += in;
+    }
+    return true;
+  }
+
+  int Core::make_listener() const {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) return -1;
+
+    // Every worker binds the same port and the kernel balances between them
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+    sockaddr_in server;
+    std::memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = INADDR_ANY;
+    server.sin_port = htons(this->port);
+
+    if (bind(sockfd, reinterpret_cast<sockaddr*>(&server), sizeof(server)) < 0
+        || listen(sockfd, SOMAXCONN) < 0) {
+      close(sockfd);
+      return -1;
+    }
+
+    return sockfd;
   }
 
   int Core::Run(int argc, char** argv) {
@@ -310,42 +1005,100 @@ namespace swerver {
     err = this->init_system_file(this->logfile, ".log");
     if (!err) return EXIT_FAILURE;
 
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    this->access_log.reset(new AccessLog(this->logfile, LOG_MAX_SIZE, LOG_KEEP));
+    if (!this->access_log->start()) {
+      std::cerr << "Failed to open the access log in " << this->logfile << ", not logging" << std::endl;
+      this->access_log.reset();
+    }
 
-    sockaddr_in server, client;
-    server.sin_family = AF_INET;
-    server.sin_addr.s_addr = INADDR_ANY;
-    server.sin_port = htons(this->port);
+    if (this->cache_mb > 0) {
+      this->cache.reset(new FileCache(this->docroot, size_t(this->cache_mb) << 20, CACHE_MAX_ENTRY));
+      if (!this->cache->start()) {
+        std::cerr << "Failed to watch " << this->docroot << ", not caching files" << std::endl;
+        this->cache.reset();
+      }
+    }
 
-    int b = bind(sockfd, reinterpret_cast<sockaddr*>(&server), sizeof(server));
-    if (b < 0) {
-      std::cerr << "Failed to bind to port: " << this->port << std::endl;
-      return EXIT_FAILURE;
+    // A client hanging up mid-sendfile shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    // No SA_RESTART, so a worker blocked in the kernel wakes up to notice
+    struct sigaction stop = {};
+    stop.sa_handler = on_stop;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGTERM, &stop, nullptr);
+    sigaction(SIGINT, &stop, nullptr);
+
+    // Every connection is a descriptor, take all we are allowed
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      getrlimit(RLIMIT_NOFILE, &limit);
+      if (this->max_connections <= 0) {
+        this->max_connections = static_cast<int>(std::min<rlim_t>(limit.rlim_cur / 2, 1 << 20));
+      }
+    }
+    if (this->max_connections <= 0) {
+      this->max_connections = 1024;
     }
 
-    std::cout << "Server ready for connections on port: " << this->port << std::endl;
+    if (this->workers <= 0) {
+      this->workers = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-    listen(sockfd, 10);
+    std::vector<std::unique_ptr<Worker>> reactors;
+    for (int i = 0; i < this->workers; ++i) {
+      int sockfd = this->make_listener();
+      if (sockfd < 0) {
+        std::cerr << "Failed to bind to port: " << this->port << std::endl;
+        return EXIT_FAILURE;
+      }
 
-    for(;;) {
-      // Shared pointer for safe memory usage
-      Core::thread *t = new thread();
-      t->instance = this;
-      socklen_t sin_size = sizeof client;
+      if (this->engine == "uring") {
+        std::unique_ptr<Worker> worker(new UringReactor(this, sockfd));
+        if (worker->init()) {
+          reactors.push_back(std::move(worker));
+          continue;
+        }
+        // Old kernels and sandboxes that filter io_uring still get a server
+        std::cerr << "Failed to set up io_uring, falling back to epoll" << std::endl;
+        this->engine = "epoll";
+      }
 
-      int clientfd = accept(sockfd, reinterpret_cast<sockaddr*>(&client), &sin_size);
-      t->socket = clientfd;
-      pthread_t connection;
+      reactors.emplace_back(new Reactor(this, sockfd));
+      if (!reactors.back()->init()) {
+        std::cerr << "Failed to set up epoll" << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
 
-      int thread_status = pthread_create(&connection, nullptr, Core::thread_handler, t);
-      if (thread_status < 0) {
+    std::cout << "Server ready for connections on port: " << this->port
+      << " with " << this->workers << " " << this->engine << " workers, at most "
+      << this->max_connections << " connections" << std::endl;
+
+    // The main thread is the last worker
+    std::vector<pthread_t> threads;
+    for (int i = 0; i < this->workers - 1; ++i) {
+      pthread_t worker;
+      int thread_status = pthread_create(&worker, nullptr, Worker::start, reactors[i].get());
+      if (thread_status != 0) {
         std::cerr << "Failed to create thread" << std::endl;
         return EXIT_FAILURE;
       }
+      threads.push_back(worker);
+    }
+    reactors.back()->run();
 
-      // I don't f**king care about you
-      pthread_detach(connection);
+    // Workers only come back once they have drained
+    for (pthread_t worker : threads) {
+      pthread_join(worker, nullptr);
     }
+    std::cout << "Drained, shutting down" << std::endl;
+
+    // The inotify thread still points at the cache and never stops, the
+    // process is on its way out anyway
+    this->cache.release();
 
     return EXIT_SUCCESS;
   }
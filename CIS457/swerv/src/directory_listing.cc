@@ -0,0 +1,73 @@
+#include <swerv/directory_listing.h>
+
+#include <cctype>
+#include <cstring>
+
+namespace swerver {
+  DirectoryListing::DirectoryListing(DIR* dir, std::string href) : dir(dir), href(std::move(href)) {}
+
+  DirectoryListing::~DirectoryListing() {
+    closedir(this->dir);
+  }
+
+  bool DirectoryListing::read(std::string& out, size_t max) {
+    size_t limit = out.size() + max;
+
+    if (!this->started) {
+      out += "<!DOCTYPE html>\n<html>\n<title>Index of ";
+      append_html(out, this->href);
+      out += "</title>\n<body>\n<h1>Index of ";
+      append_html(out, this->href);
+      out += "</h1>\n<ul>\n";
+      this->started = true;
+    }
+
+    // Stop while there is still room for a long name, the rest comes next
+    // time around
+    while (out.size() + 1024 < limit) {
+      dirent* entry = readdir(this->dir);
+      if (entry == nullptr) {
+        out += "</ul>\n</body>\n</html>\n";
+        return false;
+      }
+
+      std::string name(entry->d_name);
+      // Hidden files, . and .. stay out of it
+      if (name[0] == '.') continue;
+      if (entry->d_type == DT_DIR) name += '/';
+
+      out += "<li><a href=\"";
+      append_url(out, this->href + name);
+      out += "\">";
+      append_html(out, name);
+      out += "</a></li>\n";
+    }
+
+    return true;
+  }
+
+  void DirectoryListing::append_html(std::string& out, const std::string& text) {
+    for (char c : text) {
+      switch (c) {
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '&': out += "&amp;"; break;
+        case '"': out += "&quot;"; break;
+        default: out += c; break;
+      }
+    }
+  }
+
+  void DirectoryListing::append_url(std::string& out, const std::string& text) {
+    static const char* hex = "0123456789ABCDEF";
+    for (unsigned char c : text) {
+      if (std::isalnum(c) || std::strchr("/-._~", c) != nullptr) {
+        out += c;
+      } else {
+        out += '%';
+        out += hex[c >> 4];
+        out += hex[c & 15];
+      }
+    }
+  }
+} // namespace swerver
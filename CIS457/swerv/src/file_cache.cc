@@ -0,0 +1,246 @@
+#include <swerv/file_cache.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <vector>
+
+namespace swerver {
+  static const uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+    | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF
+    | IN_MOVE_SELF | IN_ONLYDIR;
+
+  FileCache::FileCache(std::string root, size_t capacity, size_t max_entry)
+    : root(std::move(root)), capacity(capacity), max_entry(max_entry) {}
+
+  bool FileCache::start() {
+    this->notify = inotify_init1(IN_CLOEXEC);
+    if (this->notify < 0) {
+      return false;
+    }
+
+    watch_tree(this->root);
+
+    pthread_t t;
+    if (pthread_create(&t, nullptr, FileCache::serve, this) != 0) {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->watched.clear();
+      return false;
+    }
+    pthread_detach(t);
+
+    return true;
+  }
+
+  std::string FileCache::key(const std::string& path, const std::string& encodings) {
+    // No path has a NUL in it, so these never collide with a real file
+    return encodings.empty() ? path : path + '\0' + encodings;
+  }
+
+  std::shared_ptr<const CachedFile> FileCache::find(const std::string& key) {
+    std::lock_guard<std::mutex> guard(this->lock);
+
+    auto it = this->entries.find(key);
+    if (it == this->entries.end()) {
+      return nullptr;
+    }
+
+    this->lru.splice(this->lru.begin(), this->lru, it->second);
+    return it->second->second;
+  }
+
+  bool FileCache::cacheable(const std::string& path, const struct stat& info) {
+    if (static_cast<size_t>(info.st_size) > this->max_entry || info.st_nlink != 1) return false;
+
+    // The name itself has to be the file, not a link to it
+    struct stat link;
+    if (lstat(path.c_str(), &link) != 0 || !S_ISREG(link.st_mode)
+        || link.st_dev != info.st_dev || link.st_ino != info.st_ino) {
+      return false;
+    }
+
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) return false;
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->watched.count(path.substr(0, slash)) > 0;
+  }
+
+  uint64_t FileCache::generation() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    return this->changes;
+  }
+
+  void FileCache::insert(const std::string& path, std::shared_ptr<const CachedFile> file, uint64_t generation) {
+    size_t size = file->headers.size() + file->body.size();
+
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (generation != this->changes || size > this->capacity) return;
+
+    auto existing = this->entries.find(path);
+    if (existing != this->entries.end()) {
+      evict(existing->second);
+    }
+
+    while (this->used + size > this->capacity && !this->lru.empty()) {
+      evict(std::prev(this->lru.end()));
+    }
+
+    this->lru.emplace_front(path, std::move(file));
+    this->entries[path] = this->lru.begin();
+    this->used += size;
+  }
+
+  void FileCache::evict(std::list<Entry>::iterator it) {
+    this->used -= it->second->headers.size() + it->second->body.size();
+    this->entries.erase(it->first);
+    this->lru.erase(it);
+  }
+
+  void FileCache::invalidate(const std::string& path) {
+    ++this->changes;
+
+    if (path.empty() || path.back() != '/') {
+      // The file itself and every encoding of it. A change to a .gz or .br
+      // sibling also changes what the file it belongs to is served as.
+      std::string base = path;
+      size_t dot = path.rfind('.');
+      if (dot != std::string::npos && (path.compare(dot, 3, ".gz") == 0 || path.compare(dot, 3, ".br") == 0)
+          && dot + 3 == path.size()) {
+        base = path.substr(0, dot);
+      }
+
+      for (const std::string& stale : { path, base, key(base, "gzip"), key(base, "br"), key(base, "br,gzip") }) {
+        auto it = this->entries.find(stale);
+        if (it != this->entries.end()) {
+          evict(it->second);
+        }
+      }
+      return;
+    }
+
+    for (auto it = this->lru.begin(); it != this->lru.end();) {
+      auto next = std::next(it);
+      if (it->first.compare(0, path.size(), path) == 0) {
+        evict(it);
+      }
+      it = next;
+    }
+  }
+
+  void FileCache::clear() {
+    ++this->changes;
+    this->lru.clear();
+    this->entries.clear();
+    this->used = 0;
+  }
+
+  void FileCache::watch_tree(const std::string& dir) {
+    int wd = inotify_add_watch(this->notify, dir.c_str(), WATCH_MASK);
+    if (wd < 0) {
+      std::cerr << "Not caching " << dir << ", inotify: " << std::strerror(errno) << std::endl;
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(this->lock);
+      this->watches[wd] = dir;
+      this->watched.insert(dir);
+    }
+
+    std::error_code ec;
+    for (const auto& child : std::filesystem::directory_iterator(dir, ec)) {
+      if (child.is_directory(ec) && !child.is_symlink(ec)) {
+        watch_tree(dir + "/" + child.path().filename().string());
+      }
+    }
+  }
+
+  void FileCache::forget_tree(const std::string& dir) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    const std::string prefix = dir + "/";
+
+    for (auto it = this->watches.begin(); it != this->watches.end();) {
+      if (it->second == dir || it->second.compare(0, prefix.size(), prefix) == 0) {
+        inotify_rm_watch(this->notify, it->first);
+        this->watched.erase(it->second);
+        it = this->watches.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    invalidate(prefix);
+  }
+
+  void FileCache::handle_events(const char* buf, size_t len) {
+    for (size_t at = 0; at < len;) {
+      const inotify_event* ev = reinterpret_cast<const inotify_event*>(buf + at);
+      at += sizeof(inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // We lost track of what changed, start over
+        std::lock_guard<std::mutex> guard(this->lock);
+        clear();
+        continue;
+      }
+
+      std::string dir;
+      {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto it = this->watches.find(ev->wd);
+        if (it == this->watches.end()) continue;
+        dir = it->second;
+
+        if (ev->mask & IN_IGNORED) {
+          // The directory itself went away
+          this->watched.erase(dir);
+          this->watches.erase(it);
+          invalidate(dir + "/");
+          continue;
+        }
+      }
+
+      if (ev->len == 0) continue;
+      const std::string path = dir + "/" + ev->name;
+
+      if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          forget_tree(path);
+        } else if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+          watch_tree(path);
+        }
+        continue;
+      }
+
+      std::lock_guard<std::mutex> guard(this->lock);
+      invalidate(path);
+    }
+  }
+
+  void* FileCache::serve(void* args) {
+    FileCache* cache = static_cast<FileCache*>(args);
+    alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+
+    for (;;) {
+      ssize_t len = read(cache->notify, buf, sizeof(buf));
+      if (len < 0) {
+        if (errno == EINTR) continue;
+        std::cerr << "inotify read failed, caching stops" << std::endl;
+        std::lock_guard<std::mutex> guard(cache->lock);
+        cache->watched.clear();
+        cache->clear();
+        return nullptr;
+      }
+
+      cache->handle_events(buf, len);
+    }
+
+    return nullptr;
+  }
+} // namespace swerver
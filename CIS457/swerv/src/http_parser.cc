@@ -0,0 +1,179 @@
+#include <swerv/http_parser.h>
+
+#include <strings.h>
+
+namespace swerver {
+  static std::string_view view(const std::string& buf, std::pair<size_t, size_t> at) {
+    return std::string_view(buf.data() + at.first, at.second);
+  }
+
+  static bool equals_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+  }
+
+  // Whether a comma separated header value lists token
+  static bool has_token(std::string_view value, std::string_view token) {
+    while (!value.empty()) {
+      size_t comma = value.find(',');
+      std::string_view item = value.substr(0, comma);
+      while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) item.remove_prefix(1);
+      while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) item.remove_suffix(1);
+      if (equals_nocase(item, token)) return true;
+      if (comma == std::string_view::npos) break;
+      value.remove_prefix(comma + 1);
+    }
+    return false;
+  }
+
+  std::string_view Request::header(std::string_view name) const {
+    for (const auto& field : this->headers) {
+      if (equals_nocase(field.first, name)) {
+        return field.second;
+      }
+    }
+    return std::string_view();
+  }
+
+  void RequestParser::reset() {
+    this->fresh = true;
+    // Whatever is left of the body still has to go before the next request
+    this->state = this->body_left > 0 ? body : request_line;
+    this->fields.clear();
+  }
+
+  size_t RequestParser::skip_body(size_t have) {
+    if (!this->fresh || this->state != body) return 0;
+
+    size_t n = have < this->body_left ? have : this->body_left;
+    this->body_left -= n;
+    if (this->body_left == 0) {
+      this->state = request_line;
+    }
+    return n;
+  }
+
+  void RequestParser::shift(size_t n) {
+    if (this->fresh) return;
+
+    this->origin -= n;
+    this->start -= n;
+    this->pos -= n;
+    this->method.first -= n;
+    this->target.first -= n;
+    this->version.first -= n;
+    for (auto& field : this->fields) {
+      field.first.first -= n;
+      field.second.first -= n;
+    }
+  }
+
+  RequestParser::Status RequestParser::parse(const std::string& buf, size_t start) {
+    if (this->fresh) {
+      this->fresh = false;
+      this->origin = start;
+      this->start = start;
+      this->pos = start;
+    }
+
+    for (;;) {
+      size_t nl = buf.find('\n', this->pos);
+      if (nl == std::string::npos) {
+        return buf.size() - this->start > MAX_HEAD ? bad : incomplete;
+      }
+      if (nl - this->start > MAX_HEAD) return bad;
+
+      size_t from = this->pos;
+      size_t to = nl > from && buf[nl - 1] == '\r' ? nl - 1 : nl;
+      this->pos = nl + 1;
+
+      if (this->state == request_line) {
+        // Stray blank lines between requests are allowed
+        if (from == to) {
+          this->start = this->pos;
+          continue;
+        }
+        if (!on_request_line(buf, from, to)) return bad;
+        this->state = header_lines;
+      } else if (from == to) {
+        this->head_end = this->pos;
+        if (!finish_head(buf)) return bad;
+        break;
+      } else if (!on_header_line(buf, from, to)) {
+        return bad;
+      }
+    }
+
+    // We don't take bodies, so the request is answered as soon as the head
+    // is in. What body came with it goes now and skip_body() drops the rest
+    // as it arrives, so it never piles up in the buffer.
+    size_t have = buf.size() - this->pos;
+    size_t taken = have < this->body_left ? have : this->body_left;
+    this->body_left -= taken;
+    this->end = this->pos + taken;
+    this->pos = this->end;
+    this->state = request_line;
+    return done;
+  }
+
+  bool RequestParser::on_request_line(const std::string& buf, size_t from, size_t to) {
+    size_t sp1 = buf.find(' ', from);
+    if (sp1 == std::string::npos || sp1 >= to) return false;
+    size_t sp2 = buf.find(' ', sp1 + 1);
+    if (sp2 == std::string::npos || sp2 >= to) return false;
+
+    this->method = { from, sp1 - from };
+    this->target = { sp1 + 1, sp2 - sp1 - 1 };
+    this->version = { sp2 + 1, to - sp2 - 1 };
+
+    return this->method.second > 0 && this->target.second > 0
+      && buf.compare(this->version.first, 5, "HTTP/") == 0;
+  }
+
+  bool RequestParser::on_header_line(const std::string& buf, size_t from, size_t to) {
+    size_t colon = buf.find(':', from);
+    if (colon == std::string::npos || colon >= to || colon == from) return false;
+
+    size_t value = colon + 1;
+    while (value < to && (buf[value] == ' ' || buf[value] == '\t')) ++value;
+    size_t value_end = to;
+    while (value_end > value && (buf[value_end - 1] == ' ' || buf[value_end - 1] == '\t')) --value_end;
+
+    this->fields.push_back({ { from, colon - from }, { value, value_end - value } });
+    return true;
+  }
+
+  void RequestParser::make_request(const std::string& buf) {
+    this->req.method = view(buf, this->method);
+    this->req.target = view(buf, this->target);
+    this->req.version = view(buf, this->version);
+    this->req.head = std::string_view(buf.data() + this->start, this->head_end - this->start);
+    this->req.headers.clear();
+    for (const auto& field : this->fields) {
+      this->req.headers.emplace_back(view(buf, field.first), view(buf, field.second));
+    }
+  }
+
+  bool RequestParser::finish_head(const std::string& buf) {
+    make_request(buf);
+
+    // A chunked body we couldn't find the end of
+    if (!this->req.header("Transfer-Encoding").empty()) return false;
+
+    std::string_view length = this->req.header("Content-Length");
+    this->body_left = 0;
+    for (char c : length) {
+      if (c < '0' || c > '9' || this->body_left > (size_t(1) << 40)) return false;
+      this->body_left = this->body_left * 10 + (c - '0');
+    }
+
+    // HTTP/1.1 keeps the connection unless told otherwise, 1.0 the reverse
+    std::string_view connection = this->req.header("Connection");
+    if (this->req.version == "HTTP/1.0") {
+      this->req.keep_alive = has_token(connection, "keep-alive");
+    } else {
+      this->req.keep_alive = !has_token(connection, "close");
+    }
+
+    return true;
+  }
+} // namespace swerver
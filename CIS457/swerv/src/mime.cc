@@ -0,0 +1,80 @@
+#include <swerv/mime.h>
+
+#include <fstream>
+#include <sstream>
+
+namespace swerver {
+  static const std::string_view DEFAULT_TYPE = "application/octet-stream";
+
+  bool MimeTypes::load(const std::string& path) {
+    std::ifstream f(path);
+    if (!f.good()) return false;
+
+    std::vector<mime::Entry> entries;
+    for (const auto& slot : this->slots) {
+      if (!slot.extension.empty()) entries.push_back(slot);
+    }
+
+    std::string line;
+    while (std::getline(f, line)) {
+      line = line.substr(0, line.find('#'));
+      std::istringstream words(line);
+      std::string type, ext;
+      if (!(words >> type)) continue;
+
+      this->storage.push_back(type);
+      std::string_view type_view = this->storage.back();
+      while (words >> ext) {
+        for (auto& c : ext) c = mime::lower(c);
+        this->storage.push_back(ext);
+
+        // Later lines win, like they do for everyone else reading the file
+        bool replaced = false;
+        for (auto& e : entries) {
+          if (e.extension == ext) {
+            e.type = type_view;
+            replaced = true;
+          }
+        }
+        if (!replaced) entries.push_back({ this->storage.back(), type_view });
+      }
+    }
+
+    // Half full at most, so a miss hits an empty slot after a probe or two
+    size_t size = 16;
+    while (size < entries.size() * 2) size *= 2;
+
+    std::vector<mime::Entry> table(size);
+    for (const auto& e : entries) {
+      size_t i = mime::hash(e.extension, 0) & (size - 1);
+      while (!table[i].extension.empty()) i = (i + 1) & (size - 1);
+      table[i] = e;
+    }
+    this->slots.swap(table);
+    return true;
+  }
+
+  std::string_view MimeTypes::lookup(std::string_view path) const {
+    std::string_view ext = mime::extension(path);
+    if (ext.empty()) return DEFAULT_TYPE;
+
+    // Linear probing, and the table is never full so this stops
+    if (!this->slots.empty()) {
+      size_t mask = this->slots.size() - 1;
+      for (size_t i = mime::hash(ext, 0) & mask; !this->slots[i].extension.empty(); i = (i + 1) & mask) {
+        if (mime::equals_nocase(this->slots[i].extension, ext)) return this->slots[i].type;
+      }
+    }
+
+    std::string_view type = mime::builtin_type(ext);
+    return type.empty() ? DEFAULT_TYPE : type;
+  }
+
+  bool MimeTypes::compressible(std::string_view type) {
+    return type.substr(0, 5) == "text/"
+      || type == "application/javascript"
+      || type == "application/json"
+      || type == "application/xml"
+      || type == "image/svg+xml";
+  }
+} // namespace swerver
@@ -0,0 +1,311 @@
+#include <swerv/reactor.h>
+
+#include <swerv/core.h>
+
+#include <cerrno>
+#include <iostream>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace swerver {
+  // Events handled per epoll_wait
+  static const int MAX_EVENTS = 256;
+
+  // Byte pieces gathered into a single sendmsg
+  static const int MAX_IOV = 64;
+
+  // Longest epoll_wait, so the timer wheel turns even when nothing happens
+  static const int TICK_MS = 1000;
+
+  // Most unparsed input read per event. Epoll is level triggered, so the
+  // rest is picked up next time round once handle_requests has used this.
+  static const size_t READ_LIMIT = 64 * 1024;
+
+  Reactor::Reactor(Core* core, int listen_socket) : core(core), listener(listen_socket) {}
+
+  Reactor::~Reactor() {
+    for (auto& entry : conns) {
+      close(entry.first);
+    }
+    if (epfd >= 0) {
+      close(epfd);
+    }
+  }
+
+  bool Reactor::init() {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+      return false;
+    }
+
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev) == 0;
+  }
+
+  void Reactor::run() {
+    epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+      int n = epoll_wait(epfd, events, MAX_EVENTS, TICK_MS);
+      if (n < 0 && errno != EINTR) {
+        std::cerr << "epoll_wait failed, worker exiting" << std::endl;
+        return;
+      }
+
+      this->now = TimerWheel::now();
+      for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == this->listener) {
+          accept_all();
+          continue;
+        }
+
+        auto it = this->conns.find(fd);
+        if (it == this->conns.end()) continue;
+        Connection& conn = it->second;
+
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          if (!on_readable(conn)) {
+            close_connection(fd);
+            continue;
+          }
+        }
+
+        bool ok = flush(conn);
+        // Requests held back while out was full
+        while (ok && conn.paused && !conn.backed_up()) {
+          this->core->handle_requests(conn);
+          ok = flush(conn);
+        }
+        if (!ok) {
+          close_connection(fd);
+          continue;
+        }
+        update(conn);
+      }
+
+      if (!tick()) return;
+    }
+  }
+
+  bool Reactor::tick() {
+    if (this->now == this->last_tick) return true;
+    this->last_tick = this->now;
+
+    if (Core::draining() && !this->draining) {
+      drain();
+    }
+
+    this->wheel.advance(this->now,
+        [this](int fd) -> Connection* {
+          auto it = this->conns.find(fd);
+          return it == this->conns.end() ? nullptr : &it->second;
+        },
+        [this](Connection& conn) { close_connection(conn.socket); });
+
+    if (this->draining) {
+      if (this->conns.empty()) return false;
+      if (this->now < this->drain_deadline) return true;
+
+      // Whoever is still not done reading gets cut off
+      std::vector<int> left;
+      for (auto& entry : this->conns) {
+        left.push_back(entry.first);
+      }
+      for (int fd : left) {
+        close_connection(fd);
+      }
+      return false;
+    }
+
+    resume_accepting();
+    return true;
+  }
+
+  void Reactor::drain() {
+    this->draining = true;
+    this->drain_deadline = this->now + DRAIN_TIMEOUT;
+
+    // The kernel sends new connections to the listeners still open, and
+    // every worker closes its own
+    if (this->accepting) {
+      epoll_ctl(epfd, EPOLL_CTL_DEL, this->listener, nullptr);
+      this->accepting = false;
+    }
+    close(this->listener);
+    this->listener = -1;
+
+    // Whoever isn't owed a response goes now, the rest once theirs is out
+    std::vector<int> idle;
+    for (auto& entry : this->conns) {
+      Connection& conn = entry.second;
+      if (conn.want_write()) {
+        conn.closing = true;
+        update(conn);
+      } else {
+        idle.push_back(entry.first);
+      }
+    }
+    for (int fd : idle) {
+      close_connection(fd);
+    }
+  }
+
+  void Reactor::pause_accepting(time_t until) {
+    this->resume_at = until;
+    if (!this->accepting) return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, this->listener, nullptr);
+    this->accepting = false;
+  }
+
+  void Reactor::resume_accepting() {
+    if (this->accepting || this->draining || this->now < this->resume_at || !this->core->has_room()) return;
+
+    // Level-triggered, so whatever queued up in the backlog wakes us at once
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = this->listener;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, this->listener, &ev) == 0) {
+      this->accepting = true;
+    }
+  }
+
+  void Reactor::accept_all() {
+    for (;;) {
+      if (!this->core->admit()) {
+        // Full, the backlog waits for someone to leave
+        pause_accepting(0);
+        return;
+      }
+
+      sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      int fd = accept4(this->listener, reinterpret_cast<sockaddr*>(&addr), &addr_len,
+          SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        this->core->release();
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+          // Retrying right away would just spin, give it a second
+          pause_accepting(this->now + 1);
+        }
+        // EAGAIN once the backlog is empty, anything else we just retry
+        // on the next wakeup
+        return;
+      }
+
+      epoll_event ev = {};
+      ev.events = EPOLLIN | EPOLLRDHUP;
+      ev.data.fd = fd;
+      if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        this->core->release();
+        continue;
+      }
+
+      Connection& conn = this->conns[fd];
+      conn.socket = fd;
+      conn.events = ev.events;
+      conn.peer = peer_name(addr);
+      conn.id = ++this->next_id;
+      conn.update_deadline(this->now, false);
+      this->wheel.watch(conn);
+    }
+  }
+
+  bool Reactor::on_readable(Connection& conn) {
+    char buf[16384];
+
+    while (!conn.closing && !conn.paused && conn.in.size() < READ_LIMIT) {
+      ssize_t in = recv(conn.socket, buf, sizeof(buf), 0);
+      if (in > 0) {
+        conn.in.append(buf, in);
+        continue;
+      }
+      if (in < 0 && errno == EINTR) continue;
+      if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (in < 0) return false;
+
+      // Client is done sending, answer what we have and then close
+      conn.closing = true;
+    }
+
+    this->core->handle_requests(conn);
+    return true;
+  }
+
+  bool Reactor::flush(Connection& conn) {
+    while (conn.want_write()) {
+      Segment& front = conn.out.front();
+      ssize_t sent;
+
+      if (front.is_file()) {
+        // Straight from the page cache, sendfile moves the offset along
+        sent = sendfile(conn.socket, front.fd, &front.offset, front.length);
+        if (sent == 0) {
+          // The file shrank under us, the Content-Length we sent is a lie
+          return false;
+        }
+        if (sent > 0) {
+          conn.wrote = true;
+          front.length -= sent;
+          if (front.length == 0) {
+            conn.out.pop_front();
+          }
+          continue;
+        }
+      } else {
+        if (conn.advance_stream()) continue;
+
+        // Every run of byte pieces, headers and bodies alike, goes out in
+        // one gathered write
+        iovec iov[MAX_IOV];
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = conn.gather(iov, MAX_IOV);
+        sent = sendmsg(conn.socket, &msg, MSG_NOSIGNAL);
+        if (sent > 0) {
+          conn.consume(sent);
+          continue;
+        }
+      }
+
+      if (errno == EINTR) continue;
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+
+    // A closing connection may still owe answers to requests held back
+    return !conn.closing || conn.paused;
+  }
+
+  void Reactor::update(Connection& conn) {
+    // Stop reading once we are closing, or EPOLLIN would fire forever on
+    // EOF, and while requests are held back
+    conn.update_deadline(this->now, conn.want_write());
+    this->wheel.watch(conn);
+
+    uint32_t wanted = (conn.closing || conn.paused ? 0u : uint32_t(EPOLLIN | EPOLLRDHUP))
+      | (conn.want_write() ? uint32_t(EPOLLOUT) : 0u);
+    if (wanted == conn.events) return;
+
+    epoll_event ev = {};
+    ev.events = wanted;
+    ev.data.fd = conn.socket;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn.socket, &ev);
+    conn.events = wanted;
+  }
+
+  void Reactor::close_connection(int socket) {
+    // Closing drops it from the epoll set too
+    close(socket);
+    this->conns.erase(socket);
+    this->core->release();
+    resume_accepting();
+  }
+} // namespace swerver
@@ -0,0 +1,21 @@
+#include <swerv/timer_wheel.h>
+
+namespace swerver {
+  TimerWheel::TimerWheel() : slots(SLOTS) {}
+
+  time_t TimerWheel::now() {
+    // Coarse is plenty at a second's resolution and skips the clock read
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+  }
+
+  void TimerWheel::watch(Connection& conn) {
+    // Never file into a slot the wheel has already walked past
+    time_t when = std::max(conn.deadline, this->current);
+    if (conn.timer != 0 && conn.timer <= when) return;
+
+    this->slots[when % SLOTS].push_back({ conn.socket, conn.id, when });
+    conn.timer = when;
+  }
+} // namespace swerver
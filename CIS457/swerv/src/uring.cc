@@ -0,0 +1,454 @@
+#include <swerv/uring.h>
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace swerver {
+  namespace uring {
+    static int io_uring_setup(unsigned entries, io_uring_params* p) {
+      return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+    }
+
+    static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+      return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+      return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+    }
+
+    Ring::~Ring() {
+      if (buf_ring != nullptr) {
+        munmap(buf_ring, buf_ring_size);
+      }
+      if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+      }
+      if (cq_ring != nullptr && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+      }
+      if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+      }
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    bool Ring::init(unsigned entries) {
+      io_uring_params p;
+      std::memset(&p, 0, sizeof(p));
+
+      // Completions are only looked at when we enter the kernel anyway, so
+      // spare us the interrupts where the kernel knows how
+      p.flags = IORING_SETUP_COOP_TASKRUN;
+      fd = io_uring_setup(entries, &p);
+      if (fd < 0 && errno == EINVAL) {
+        std::memset(&p, 0, sizeof(p));
+        fd = io_uring_setup(entries, &p);
+      }
+      if (fd < 0) {
+        return false;
+      }
+      features = p.features;
+
+      sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        cq_ring_size = sq_ring_size;
+      }
+
+      sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return false;
+      }
+
+      if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+      } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+          cq_ring = nullptr;
+          return false;
+        }
+      }
+
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (s == MAP_FAILED) {
+        return false;
+      }
+      sqes = static_cast<io_uring_sqe*>(s);
+
+      char* sq = static_cast<char*>(sq_ring);
+      sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+      sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+      sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+      sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+      sq_entries = p.sq_entries;
+
+      char* cq = static_cast<char*>(cq_ring);
+      cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+      cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+      sqe_tail = sqe_head = *sq_tail;
+
+      return true;
+    }
+
+    io_uring_sqe* Ring::get_sqe() {
+      unsigned head = reinterpret_cast<std::atomic<unsigned>*>(sq_head)->load(std::memory_order_acquire);
+      if (sqe_tail - head >= sq_entries) {
+        // Full, push what we have to the kernel and try again
+        submit_and_wait(0);
+        head = reinterpret_cast<std::atomic<unsigned>*>(sq_head)->load(std::memory_order_acquire);
+        if (sqe_tail - head >= sq_entries) {
+          return nullptr;
+        }
+      }
+
+      io_uring_sqe* sqe = &sqes[sqe_tail & *sq_mask];
+      std::memset(sqe, 0, sizeof(*sqe));
+      ++sqe_tail;
+
+      return sqe;
+    }
+
+    bool Ring::reserve(unsigned count) {
+      unsigned head = reinterpret_cast<std::atomic<unsigned>*>(sq_head)->load(std::memory_order_acquire);
+      if (sq_entries - (sqe_tail - head) >= count) {
+        return true;
+      }
+
+      submit_and_wait(0);
+      head = reinterpret_cast<std::atomic<unsigned>*>(sq_head)->load(std::memory_order_acquire);
+      return sq_entries - (sqe_tail - head) >= count;
+    }
+
+    unsigned Ring::flush_sq() {
+      unsigned tail = *sq_tail;
+      unsigned submitted = sqe_tail - sqe_head;
+
+      for (; sqe_head != sqe_tail; ++sqe_head, ++tail) {
+        sq_array[tail & *sq_mask] = sqe_head & *sq_mask;
+      }
+      reinterpret_cast<std::atomic<unsigned>*>(sq_tail)->store(tail, std::memory_order_release);
+
+      return submitted;
+    }
+
+    int Ring::submit_and_wait(unsigned wait_nr) {
+      unsigned submitted = flush_sq();
+      unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+      int r;
+      do {
+        r = io_uring_enter(fd, submitted, wait_nr, flags);
+      } while (r < 0 && errno == EINTR);
+
+      return r;
+    }
+
+    bool Ring::register_files(unsigned count) {
+      // -1 leaves a slot empty until update_file fills it
+      std::vector<int> fds(count, -1);
+      if (io_uring_register(fd, IORING_REGISTER_FILES, fds.data(), count) < 0) {
+        return false;
+      }
+      files = count;
+      return true;
+    }
+
+    bool Ring::update_file(unsigned slot, int file) {
+      if (slot >= files) {
+        return false;
+      }
+
+      io_uring_files_update update;
+      std::memset(&update, 0, sizeof(update));
+      update.offset = slot;
+      update.fds = reinterpret_cast<uint64_t>(&file);
+      return io_uring_register(fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+    }
+
+    bool Ring::limit_workers(unsigned bounded, unsigned unbounded) {
+      unsigned counts[2] = { bounded, unbounded };
+      return io_uring_register(fd, IORING_REGISTER_IOWQ_MAX_WORKERS, counts, 2) == 0;
+    }
+
+    bool Ring::setup_buffers(uint16_t group, unsigned count, unsigned size) {
+      buf_group = group;
+      buf_entries = count;
+      buffer_size = size;
+      buffers.resize(static_cast<size_t>(count) * size);
+
+      buf_ring_size = count * sizeof(io_uring_buf);
+      void* r = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+          MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+      if (r == MAP_FAILED) {
+        return false;
+      }
+      buf_ring = static_cast<io_uring_buf_ring*>(r);
+      buf_ring->tail = 0;
+
+      for (unsigned i = 0; i < count; ++i) {
+        recycle(static_cast<uint16_t>(i));
+      }
+
+      io_uring_buf_reg reg;
+      std::memset(&reg, 0, sizeof(reg));
+      reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+      reg.ring_entries = count;
+      reg.bgid = group;
+      if (io_uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0 && buffers_work()) {
+        return true;
+      }
+
+      // Some kernels take the registration and then never hand a buffer out,
+      // the old one-shot PROVIDE_BUFFERS does the same job a bit slower
+      io_uring_register(fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+      munmap(buf_ring, buf_ring_size);
+      buf_ring = nullptr;
+
+      io_uring_sqe* sqe = get_sqe();
+      sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+      sqe->fd = count;
+      sqe->addr = reinterpret_cast<uint64_t>(buffers.data());
+      sqe->len = size;
+      sqe->buf_group = group;
+      sqe->off = 0;
+
+      int res = -1;
+      submit_and_wait(1);
+      for_each_cqe([&res](const io_uring_cqe& cqe) { res = cqe.res; });
+
+      return res >= 0 && buffers_work();
+    }
+
+    bool Ring::buffers_work() {
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return false;
+      }
+
+      char c = 0;
+      write(sv[1], &c, 1);
+
+      io_uring_sqe* sqe = get_sqe();
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = sv[0];
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = buf_group;
+
+      int res = -1;
+      uint32_t flags = 0;
+      submit_and_wait(1);
+      for_each_cqe([&](const io_uring_cqe& cqe) {
+        res = cqe.res;
+        flags = cqe.flags;
+      });
+
+      close(sv[0]);
+      close(sv[1]);
+
+      if (res != 1) {
+        return false;
+      }
+      recycle(flags >> IORING_CQE_BUFFER_SHIFT);
+
+      return true;
+    }
+
+    bool Ring::multishot_works() {
+      static const uint64_t PROBE = 1;
+
+      // Connected before the accept goes in, so it completes straight away
+      int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      sockaddr_in addr;
+      std::memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof(addr);
+
+      bool accepts = listener >= 0 && client >= 0
+        && bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0
+        && listen(listener, 1) == 0
+        && getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len) == 0
+        && connect(client, reinterpret_cast<sockaddr*>(&addr), len) == 0;
+      if (accepts) {
+        prep_multishot_accept(get_sqe(), listener, PROBE);
+        io_uring_cqe cqe = probe(PROBE);
+        if (cqe.res >= 0) {
+          close(cqe.res);
+        }
+        accepts = cqe.res >= 0 && (cqe.flags & IORING_CQE_F_MORE);
+      }
+      if (listener >= 0) {
+        close(listener);
+      }
+      if (client >= 0) {
+        close(client);
+      }
+      if (!accepts) {
+        return false;
+      }
+
+      int sv[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return false;
+      }
+      char c = 0;
+      write(sv[1], &c, 1);
+
+      prep_multishot_recv(get_sqe(), sv[0], buf_group, PROBE);
+      io_uring_cqe cqe = probe(PROBE);
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      }
+
+      close(sv[0]);
+      close(sv[1]);
+
+      return cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+    }
+
+    io_uring_cqe Ring::probe(uint64_t user_data) {
+      io_uring_cqe first;
+      std::memset(&first, 0, sizeof(first));
+      first.res = -EIO;
+      bool seen = false;
+      bool live = true;
+      bool cancelled = false;
+
+      while (live && submit_and_wait(1) >= 0) {
+        for_each_cqe([&](const io_uring_cqe& cqe) {
+          if (cqe.user_data != user_data) return;
+          if (!seen) {
+            first = cqe;
+            seen = true;
+          }
+          live = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        });
+
+        if (live && seen && !cancelled) {
+          io_uring_sqe* sqe = get_sqe();
+          prep_cancel(sqe, user_data, 0);
+          sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+          cancelled = true;
+        }
+      }
+
+      return first;
+    }
+
+    void Ring::recycle(uint16_t bid) {
+      if (buf_ring == nullptr) {
+        // Fallback mode, one small submission per buffer and no completion
+        // unless it fails
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+          unrecycled.push_back(bid);
+          return;
+        }
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        sqe->len = buffer_size;
+        sqe->buf_group = buf_group;
+        sqe->off = bid;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        return;
+      }
+
+      unsigned short tail = buf_ring->tail;
+      io_uring_buf& b = buf_ring->bufs[tail & (buf_entries - 1)];
+      b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+      b.len = buffer_size;
+      b.bid = bid;
+
+      reinterpret_cast<std::atomic<unsigned short>*>(&buf_ring->tail)->store(tail + 1, std::memory_order_release);
+    }
+
+    void Ring::retry_recycles() {
+      std::vector<uint16_t> waiting;
+      waiting.swap(unrecycled);
+      for (uint16_t bid : waiting) {
+        recycle(bid);
+      }
+    }
+
+    void prep_multishot_accept(io_uring_sqe* sqe, int fd, uint64_t user_data) {
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = fd;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+      sqe->user_data = user_data;
+    }
+
+    void prep_multishot_recv(io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = group;
+      sqe->user_data = user_data;
+    }
+
+    void prep_sendmsg(io_uring_sqe* sqe, int fd, const msghdr* msg, unsigned flags, uint64_t user_data) {
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<uint64_t>(msg);
+      sqe->len = 1;
+      sqe->msg_flags = flags;
+      sqe->user_data = user_data;
+    }
+
+    void prep_poll(io_uring_sqe* sqe, int fd, unsigned events, uint64_t user_data) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = fd;
+      sqe->poll32_events = events;
+      sqe->user_data = user_data;
+    }
+
+    void prep_timeout(io_uring_sqe* sqe, const __kernel_timespec* ts, uint64_t user_data) {
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = reinterpret_cast<uint64_t>(ts);
+      sqe->len = 1;
+      sqe->user_data = user_data;
+    }
+
+    void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = target;
+      sqe->user_data = user_data;
+    }
+
+    void prep_splice(io_uring_sqe* sqe, int fd_in, int64_t off_in, int fd_out, int64_t off_out,
+        unsigned length, unsigned flags, uint64_t user_data) {
+      sqe->opcode = IORING_OP_SPLICE;
+      sqe->fd = fd_out;
+      sqe->off = static_cast<uint64_t>(off_out);
+      sqe->splice_fd_in = fd_in;
+      sqe->splice_off_in = static_cast<uint64_t>(off_in);
+      sqe->len = length;
+      sqe->splice_flags = flags;
+      sqe->user_data = user_data;
+    }
+  } // namespace uring
+} // namespace swerver
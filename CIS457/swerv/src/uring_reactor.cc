@@ -0,0 +1,538 @@
+#include <swerv/uring_reactor.h>
+
+#include <swerv/core.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <vector>
+
+namespace swerver {
+  // Submission slots, completions get twice as many
+  static const unsigned RING_ENTRIES = 4096;
+
+  // Provided receive buffers, shared by every connection on the worker
+  static const uint16_t BUFFER_GROUP = 0;
+  static const unsigned BUFFER_COUNT = 512;
+  static const unsigned BUFFER_SIZE = 16384;
+
+  // Most sockets we keep in the registered table, sockets past it go by
+  // descriptor
+  static const unsigned FIXED_FILES = 65536;
+
+  // File bytes moved per splice, what a default pipe holds
+  static const size_t PIPE_CHUNK = 64 * 1024;
+
+  // Kernel threads the ring may run splices on, of each kind
+  static const unsigned IO_WORKERS = 16;
+
+  // What a completion was for, in the low byte of user_data with the
+  // socket above it. 0 is left for failed buffer recycles.
+  enum Op : uint64_t {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_SPLICE_IN,
+    OP_SPLICE_OUT,
+    OP_TICK,
+    OP_CANCEL,
+    OP_POLL
+  };
+
+  static uint64_t key(int fd, Op op) {
+    return (static_cast<uint64_t>(fd) << 8) | op;
+  }
+
+  UringReactor::UringReactor(Core* core, int listen_socket) : core(core), listener(listen_socket) {}
+
+  UringReactor::~UringReactor() {
+    for (auto& entry : this->sessions) {
+      Session& session = entry.second;
+      if (session.pipe[0] >= 0) {
+        close(session.pipe[0]);
+        close(session.pipe[1]);
+      }
+      close(entry.first);
+    }
+  }
+
+  bool UringReactor::init() {
+    if (!this->ring.init(RING_ENTRIES)) {
+      return false;
+    }
+    // Buffer recycles and cancels post nothing when they work, which needs
+    // 5.17. Without it every one of them would come back as a completion.
+    if (!this->ring.has_feature(IORING_FEAT_CQE_SKIP)) {
+      return false;
+    }
+    if (!this->ring.setup_buffers(BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE)) {
+      return false;
+    }
+    // Accepts and receives are multishot, 5.19 and 6.0. An older kernel
+    // turns them down and the worker would only spin re-arming them.
+    if (!this->ring.multishot_works()) {
+      return false;
+    }
+
+    // The table can't be bigger than we are allowed descriptors. Without
+    // one sockets just go by descriptor.
+    rlimit limit;
+    unsigned slots = FIXED_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < slots) {
+      slots = limit.rlim_cur;
+    }
+    this->ring.register_files(slots);
+
+    // Splices run on kernel threads. Sockets are non-blocking so none of
+    // them should sit waiting on a client, but don't let a pile of slow
+    // readers spawn one each if they do.
+    this->ring.limit_workers(IO_WORKERS, IO_WORKERS);
+
+    arm_accept();
+    arm_tick();
+    return true;
+  }
+
+  void UringReactor::run() {
+    for (;;) {
+      this->ring.retry_recycles();
+
+      // EBUSY just means completions need reaping before more go in
+      if (this->ring.submit_and_wait(1) < 0 && errno != EBUSY && errno != EAGAIN) {
+        std::cerr << "io_uring_enter failed, worker exiting" << std::endl;
+        return;
+      }
+
+      this->now = TimerWheel::now();
+      this->ring.for_each_cqe([this](const io_uring_cqe& cqe) {
+        Op op = static_cast<Op>(cqe.user_data & 0xff);
+        if (op == OP_ACCEPT) {
+          on_accept(cqe);
+          return;
+        }
+        if (op == OP_TICK) {
+          arm_tick();
+          return;
+        }
+
+        auto it = this->sessions.find(static_cast<int>(cqe.user_data >> 8));
+        if (it == this->sessions.end()) return;
+        Session& session = it->second;
+
+        switch (op) {
+          case OP_RECV: on_recv(session, cqe); break;
+          case OP_SEND: on_send(session, cqe); break;
+          case OP_SPLICE_IN: on_splice_in(session, cqe); break;
+          case OP_SPLICE_OUT: on_splice_out(session, cqe); break;
+          default: return;
+        }
+
+        if (session.done) {
+          reap(session);
+          return;
+        }
+        session.conn.update_deadline(this->now, session.conn.want_write() || session.piped > 0);
+        this->wheel.watch(session.conn);
+      });
+
+      if (!tick()) return;
+    }
+  }
+
+  bool UringReactor::tick() {
+    if (this->now == this->last_tick) return true;
+    this->last_tick = this->now;
+
+    if (Core::draining() && !this->draining) {
+      drain();
+    }
+
+    this->wheel.advance(this->now,
+        [this](int fd) -> Connection* {
+          auto it = this->sessions.find(fd);
+          return it == this->sessions.end() || it->second.done ? nullptr : &it->second.conn;
+        },
+        [this](Connection& conn) {
+          Session& session = this->sessions[conn.socket];
+          shut(session);
+          reap(session);
+        });
+
+    if (this->draining) {
+      if (this->sessions.empty()) return false;
+      if (this->now >= this->drain_deadline && !this->forced) {
+        // Whoever is still not done reading gets cut off. Their requests
+        // come back from the kernel right after and free the sessions.
+        this->forced = true;
+        std::vector<int> left;
+        for (auto& entry : this->sessions) {
+          left.push_back(entry.first);
+        }
+        for (int fd : left) {
+          Session& session = this->sessions[fd];
+          shut(session);
+          reap(session);
+        }
+      }
+      return true;
+    }
+
+    resume_accepting();
+    return true;
+  }
+
+  void UringReactor::drain() {
+    this->draining = true;
+    this->drain_deadline = this->now + DRAIN_TIMEOUT;
+
+    // The kernel sends new connections to the listeners still open, and
+    // every worker closes its own. A cancelled accept lets go of it.
+    pause_accepting(0);
+    close(this->listener);
+
+    // Whoever isn't owed a response goes now, the rest once theirs is out
+    std::vector<int> idle;
+    for (auto& entry : this->sessions) {
+      Session& session = entry.second;
+      if (session.conn.want_write() || session.piped > 0 || session.sending) {
+        session.conn.closing = true;
+      } else {
+        idle.push_back(entry.first);
+      }
+    }
+    for (int fd : idle) {
+      Session& session = this->sessions[fd];
+      shut(session);
+      reap(session);
+    }
+  }
+
+  void UringReactor::arm_tick() {
+    io_uring_sqe* sqe = this->ring.get_sqe();
+    if (sqe == nullptr) return;
+    uring::prep_timeout(sqe, &this->tick_interval, key(0, OP_TICK));
+  }
+
+  void UringReactor::pause_accepting(time_t until) {
+    this->resume_at = until;
+    if (!this->accepting) return;
+    this->accepting = false;
+
+    if (this->accept_armed) {
+      io_uring_sqe* sqe = this->ring.get_sqe();
+      if (sqe == nullptr) return;
+      uring::prep_cancel(sqe, key(this->listener, OP_ACCEPT), key(0, OP_CANCEL));
+      sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+    }
+  }
+
+  void UringReactor::resume_accepting() {
+    if (this->accepting || this->draining || this->now < this->resume_at || !this->core->has_room()) return;
+
+    this->accepting = true;
+    if (!this->accept_armed) {
+      arm_accept();
+    }
+  }
+
+  void UringReactor::arm_accept() {
+    io_uring_sqe* sqe = this->ring.get_sqe();
+    if (sqe == nullptr) {
+      std::cerr << "Submission queue full, not accepting" << std::endl;
+      return;
+    }
+    uring::prep_multishot_accept(sqe, this->listener, key(this->listener, OP_ACCEPT));
+    this->accept_armed = true;
+  }
+
+  bool UringReactor::arm_recv(Session& session) {
+    io_uring_sqe* sqe = this->ring.get_sqe();
+    if (sqe == nullptr) return false;
+
+    uring::prep_multishot_recv(sqe, session.conn.socket, BUFFER_GROUP, key(session.conn.socket, OP_RECV));
+    target(sqe, session);
+    session.receiving = true;
+    return true;
+  }
+
+  void UringReactor::target(io_uring_sqe* sqe, const Session& session) const {
+    // A socket's slot is its descriptor, so only the flag changes
+    if (session.fixed) {
+      sqe->flags |= IOSQE_FIXED_FILE;
+    }
+  }
+
+  void UringReactor::on_accept(const io_uring_cqe& cqe) {
+    // The kernel drops a multishot accept when it runs into trouble, or
+    // when we cancelled it
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      this->accept_armed = false;
+    }
+
+    if (cqe.res < 0) {
+      // Re-arming straight into the same error would just spin, out of
+      // descriptors most likely, so give it a second
+      if (cqe.res != -ECANCELED) {
+        pause_accepting(this->now + 1);
+      }
+      return;
+    }
+
+    int fd = cqe.res;
+    if (this->draining || !this->core->admit()) {
+      // Already accepted by the time we hear of it, all we can do is turn
+      // it away and stop the kernel taking more
+      close(fd);
+      pause_accepting(0);
+      return;
+    }
+
+    if (!this->accept_armed && this->accepting) {
+      arm_accept();
+    }
+
+    Session& session = this->sessions[fd];
+    session.conn.socket = fd;
+    session.conn.id = ++this->next_id;
+
+    sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) == 0) {
+      session.conn.peer = peer_name(addr);
+    } else {
+      session.conn.peer = "-";
+    }
+
+    // Saves the kernel a descriptor lookup on every request for the socket
+    session.fixed = this->ring.update_file(fd, fd);
+
+    if (!arm_recv(session)) {
+      shut(session);
+      reap(session);
+      return;
+    }
+    session.conn.update_deadline(this->now, false);
+    this->wheel.watch(session.conn);
+  }
+
+  void UringReactor::on_recv(Session& session, const io_uring_cqe& cqe) {
+    Connection& conn = session.conn;
+    session.receiving = (cqe.flags & IORING_CQE_F_MORE) != 0;
+
+    if (cqe.res > 0) {
+      uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+      if (!session.done && !conn.closing) {
+        conn.in.append(this->ring.buffer(bid), cqe.res);
+      }
+      this->ring.recycle(bid);
+    }
+    if (session.done) return;
+
+    if (cqe.res == 0) {
+      // Client is done sending, answer what we have and then close
+      conn.closing = true;
+    } else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+      shut(session);
+      return;
+    }
+
+    this->core->handle_requests(conn);
+
+    if (conn.paused) {
+      // Nothing more is read until out drains, flush picks up from there
+      if (session.receiving) {
+        stop_recv(session);
+      }
+    } else if (!session.receiving && !conn.closing && !arm_recv(session)) {
+      // Ran out of buffers or the kernel stopped for its own reasons
+      shut(session);
+      return;
+    }
+    flush(session);
+  }
+
+  void UringReactor::stop_recv(Session& session) {
+    io_uring_sqe* sqe = this->ring.get_sqe();
+    if (sqe == nullptr) return;
+
+    // Anything already received still comes in before the -ECANCELED
+    uring::prep_cancel(sqe, key(session.conn.socket, OP_RECV), key(0, OP_CANCEL));
+    sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+  }
+
+  void UringReactor::flush(Session& session) {
+    if (session.sending || session.done) return;
+    Connection& conn = session.conn;
+
+    // Requests held back while out was full
+    if (conn.paused && !conn.backed_up()) {
+      this->core->handle_requests(conn);
+      if (!conn.paused && !session.receiving && !conn.closing && !arm_recv(session)) {
+        shut(session);
+        return;
+      }
+    }
+
+    for (;;) {
+      // Whatever sits in the pipe goes before anything queued after it
+      if (session.piped > 0 || (conn.want_write() && conn.out.front().is_file())) {
+        if (!splice_file(session)) {
+          shut(session);
+        }
+        return;
+      }
+      if (!conn.want_write()) break;
+      if (conn.advance_stream()) continue;
+
+      io_uring_sqe* sqe = this->ring.get_sqe();
+      if (sqe == nullptr) {
+        shut(session);
+        return;
+      }
+
+      session.msg = {};
+      session.msg.msg_iov = session.iov;
+      session.msg.msg_iovlen = conn.gather(session.iov, MAX_IOV);
+      uring::prep_sendmsg(sqe, conn.socket, &session.msg, MSG_NOSIGNAL, key(conn.socket, OP_SEND));
+      target(sqe, session);
+      session.sending = true;
+      return;
+    }
+
+    if (conn.closing) {
+      shut(session);
+    }
+  }
+
+  bool UringReactor::splice_file(Session& session) {
+    Connection& conn = session.conn;
+    if (session.pipe[0] < 0 && pipe2(session.pipe, O_CLOEXEC) < 0) {
+      return false;
+    }
+
+    if (session.piped > 0) {
+      // The socket took less than we spliced in, send the rest once it
+      // has room
+      if (!this->ring.reserve(2)) return false;
+      wait_writable(session);
+
+      io_uring_sqe* sqe = this->ring.get_sqe();
+      uring::prep_splice(sqe, session.pipe[0], -1, conn.socket, -1, session.piped, 0,
+          key(conn.socket, OP_SPLICE_OUT));
+      target(sqe, session);
+      session.sending = true;
+      return true;
+    }
+
+    // File into the pipe, then linked straight on, pipe into the socket.
+    // Only page references move, the bytes stay in the page cache.
+    Segment& front = conn.out.front();
+    unsigned length = static_cast<unsigned>(std::min(front.length, PIPE_CHUNK));
+    if (!this->ring.reserve(3)) return false;
+
+    io_uring_sqe* in = this->ring.get_sqe();
+    uring::prep_splice(in, front.fd, front.offset, session.pipe[1], -1, length, 0,
+        key(conn.socket, OP_SPLICE_IN));
+    in->flags |= IOSQE_IO_LINK;
+    wait_writable(session);
+
+    io_uring_sqe* out = this->ring.get_sqe();
+    uring::prep_splice(out, session.pipe[0], -1, conn.socket, -1, length, 0,
+        key(conn.socket, OP_SPLICE_OUT));
+    target(out, session);
+
+    session.sending = true;
+    return true;
+  }
+
+  void UringReactor::wait_writable(Session& session) {
+    // Splices into a socket run on a kernel thread with no poll of their
+    // own, so without this one that found the socket full would just come
+    // back -EAGAIN
+    io_uring_sqe* sqe = this->ring.get_sqe();
+    uring::prep_poll(sqe, session.conn.socket, POLLOUT, key(session.conn.socket, OP_POLL));
+    target(sqe, session);
+    sqe->flags |= IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+  }
+
+  void UringReactor::on_splice_in(Session& session, const io_uring_cqe& cqe) {
+    if (session.done) return;
+
+    // Nothing read means the file shrank under us, the Content-Length we
+    // sent is a lie
+    if (cqe.res <= 0) {
+      shut(session);
+      return;
+    }
+
+    Segment& front = session.conn.out.front();
+    front.offset += cqe.res;
+    front.length -= cqe.res;
+    session.piped += cqe.res;
+    if (front.length == 0) {
+      session.conn.out.pop_front();
+    }
+  }
+
+  void UringReactor::on_splice_out(Session& session, const io_uring_cqe& cqe) {
+    session.sending = false;
+    if (cqe.res > 0) {
+      session.piped -= cqe.res;
+      session.conn.wrote = true;
+    }
+    if (session.done) return;
+
+    // Cancelled when the splice in came up short, which it handles, and
+    // -EAGAIN when the socket filled up again after the poll. Either way
+    // flush goes again. The pipe is never empty when we splice out of it,
+    // so 0 is trouble.
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ECANCELED && cqe.res != -EAGAIN)) {
+      shut(session);
+      return;
+    }
+    flush(session);
+  }
+
+  void UringReactor::on_send(Session& session, const io_uring_cqe& cqe) {
+    session.sending = false;
+    if (session.done) return;
+
+    if (cqe.res < 0) {
+      shut(session);
+      return;
+    }
+    session.conn.consume(cqe.res);
+    flush(session);
+  }
+
+  void UringReactor::shut(Session& session) {
+    if (session.done) return;
+    session.done = true;
+
+    // Ends the multishot receive with a 0 and fails anything still waiting
+    // to send, data already on the socket still goes out first
+    shutdown(session.conn.socket, SHUT_RDWR);
+  }
+
+  bool UringReactor::reap(Session& session) {
+    if (session.receiving || session.sending) return false;
+
+    int fd = session.conn.socket;
+    if (session.fixed) {
+      this->ring.update_file(fd, -1);
+    }
+    if (session.pipe[0] >= 0) {
+      close(session.pipe[0]);
+      close(session.pipe[1]);
+    }
+    close(fd);
+    this->sessions.erase(fd);
+    this->core->release();
+    resume_accepting();
+    return true;
+  }
+} // namespace swerver
@@ -0,0 +1,50 @@
+// Request framing checks for RequestParser, run by ctest
+#include <swerv/http_parser.h>
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+using swerver::RequestParser;
+
+static int failures = 0;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+// Feeds buf the way Core::handle_requests does and returns the methods of
+// the requests it found, space separated
+static std::string methods(const std::string& buf) {
+  RequestParser parser;
+  std::string found;
+  size_t start = 0;
+
+  for (;;) {
+    start += parser.skip_body(buf.size() - start);
+    if (parser.in_body()) break;
+    if (parser.parse(buf, start) != RequestParser::done) break;
+
+    if (!found.empty()) found += ' ';
+    found += std::string(parser.request().method);
+    start += parser.consumed();
+    parser.reset();
+  }
+  return found;
+}
+
+int main() {
+  check(methods("GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n") == "GET GET",
+      "two pipelined requests");
+
+  check(methods("\r\nPOST /a HTTP/1.1\r\nContent-Length: 2\r\n\r\nyzGET /b HTTP/1.1\r\n\r\n") == "POST GET",
+      "blank line, then a request with a body, then a pipelined request");
+
+  check(methods("\r\n\r\nGET /a HTTP/1.1\r\n\r\n\r\nGET /b HTTP/1.1\r\n\r\n") == "GET GET",
+      "blank lines before each pipelined request");
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}